@@ -0,0 +1,88 @@
+#ifndef AUTO_TUNER_H
+#define AUTO_TUNER_H
+
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <functional>
+
+#include "types.hpp"
+#include "landmark_map.hpp"
+
+class Session;
+
+// applies the update settings of real sessions to the sessions a calibration times
+typedef std::function< void(Session& session) > SessionSetup;
+
+// latency budget settings
+struct tuner_config_t {
+  uint64_t budget_ns;   // p99 frame latency budget [ns]
+  int min_particles;    // particle count range
+  int max_particles;
+  int max_threads;      // largest update thread count tried
+};
+
+// result of a calibration
+struct tuning_t {
+  int num_particles;    // largest particle count within the budget
+  int num_threads;      // update threads needed for it
+  uint64_t p99_ns;      // measured p99 frame latency [ns], 0 if even min_particles miss the budget
+};
+
+/*
+ * returns tuner settings for a budget, using all cores at most
+ * @param budget_ns p99 frame latency budget [ns]
+ */
+tuner_config_t default_tuner_config(uint64_t budget_ns);
+
+/*
+ * Measures the frame latency on this machine and picks the largest particle
+ * count and the update thread count that keep the p99 within the budget
+ * (with some headroom). For every thread count (powers of two) the particle
+ * count is doubled until the budget is missed and then bisected; more
+ * threads are only tried while they allow noticeably more particles.
+ * Frames are timed one at a time on a local filter: coalescing, islands,
+ * global localization and the flight recorder are not part of the measurement.
+ * @param tuner latency budget settings
+ * @param config filter configuration, num_particles is ignored
+ * @param frames telemetry frames to time, recorded or synthetic
+ * @param map landmark map of the frames
+ * @param log progress output, nullptr for none
+ * @param setup update settings (resampler, two-stage update, deadline, update interval)
+ *   applied to every timed session, none for the defaults
+ */
+tuning_t calibrate(const tuner_config_t& tuner, const filter_config_t& config,
+                   const std::vector<telemetry_t>& frames, const map_view_t& map, std::ostream* log,
+                   const SessionSetup& setup = SessionSetup());
+
+/*
+ * Keeps the p99 frame latency of a session within the budget by
+ * adjusting the particle count. The p99 is measured over windows of
+ * frames; the count is scaled towards the budget (frame cost is about
+ * linear in the particle count) when a window misses the budget or
+ * uses less than half of it.
+ */
+class LatencyGovernor {
+public:
+  /*
+   * Constructor
+   * @param config latency budget settings
+   */
+  explicit LatencyGovernor(const tuner_config_t& config);
+
+  /*
+   * Records a frame latency
+   * @param frame_ns frame latency [ns]
+   * @param num_particles current particle count
+   * @output particle count for the following frames
+   */
+  int update(uint64_t frame_ns, int num_particles);
+
+private:
+  tuner_config_t config_;
+
+  // frame latencies of the current window [ns]
+  std::vector<uint64_t> window_;
+};
+
+#endif
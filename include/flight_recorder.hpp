@@ -0,0 +1,90 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "types.hpp"
+#include "profiler.hpp"
+#include "particle_filter.hpp"
+
+// flight recorder settings
+struct flight_config_t {
+  size_t frames;            // frames kept before a slow frame (at least)
+  uint64_t threshold_ns;    // frame latency that triggers a dump [ns]
+  std::string directory;    // directory for dumps
+};
+
+/*
+ * Slow-frame flight recorder
+ * Keeps the inputs and stage timings of the recent frames of a session
+ * together with a snapshot of the filter state (particles and random
+ * generator) from before the oldest kept frame. When a frame exceeds the
+ * latency threshold, everything is dumped as a telemetry log starting with a
+ * state record, which replay re-runs deterministically.
+ *
+ * Snapshots are taken every `frames` frames and the previous one is kept,
+ * so between `frames` and 2 * `frames` frames are held at any time.
+ */
+class FlightRecorder {
+public:
+  /*
+   * Constructor
+   * @param session_id id of the recorded session
+   * @param config recorder settings
+   */
+  FlightRecorder(int session_id, const flight_config_t& config);
+
+  /*
+   * Records a filter iteration before it is processed
+   * @param filter filter state before the iteration
+   * @param filter_config filter configuration
+   * @param frames frame inputs, a backlog processed together (oldest first) or a single frame
+   * @param count number of frames
+   */
+  void beginFrame(const ParticleFilter& filter, const filter_config_t& filter_config,
+                  const telemetry_t* frames, size_t count);
+
+  /*
+   * Completes the current frame and dumps the recorder if it was slow.
+   * Dumps are at least `frames` frames apart.
+   * @param stage_ns latency of each stage [ns], indexed by Stage
+   * @param frame_ns latency of the whole frame [ns]
+   * @output path of the dump, empty if none was written
+   */
+  std::string endFrame(const uint64_t stage_ns[], uint64_t frame_ns);
+
+private:
+  struct entry_t {
+    size_t index;                     // iteration number in the session
+    std::vector<telemetry_t> frames;  // inputs, several for a backlog
+    std::vector<uint64_t> stage_ns; // stage latencies [ns]
+  };
+
+  /*
+   * Writes the snapshot and all kept frames to a telemetry log
+   */
+  std::string dump() const;
+
+  int session_id_;
+  flight_config_t config_;
+  filter_config_t filter_config_;
+
+  // kept frames, oldest first
+  std::deque<entry_t> frames_;
+
+  // serialized filter states and the frame numbers they were taken before
+  std::string previous_state_, current_state_;
+  size_t previous_index_, current_index_;
+
+  // number of the next frame
+  size_t frame_index_;
+
+  // frame number of the last dump
+  size_t last_dump_index_;
+  bool dumped_;
+};
+
+#endif
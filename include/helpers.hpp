@@ -6,7 +6,10 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <iterator>
 #include <exception>
+#include <chrono>
+#include <cstdint>
 
 #include "types.hpp"
 
@@ -28,6 +31,30 @@ inline double gaussian2d(double x, double y, double ux, double uy, double sigmax
          / (2 * M_PI * sigmax * sigmay);
 }
 
+/**
+ * Composes consecutive constant turn rate and velocity controls
+ * @param frames frames with the controls, oldest first
+ * @param count number of frames
+ * @param delta_t time covered by each control [s]
+ * @output displacement in the vehicle frame at the start of the first control
+ */
+inline pose_t compose_controls(const telemetry_t* frames, size_t count, double delta_t) {
+  pose_t motion{0.0, 0.0, 0.0};
+  for(size_t i = 0; i < count; ++i) {
+    double v = frames[i].prev_velocity;
+    double yaw_rate = frames[i].prev_yawrate;
+    if(std::abs(yaw_rate) > 0.00001) {
+      motion.x += v / yaw_rate * (std::sin(motion.theta + yaw_rate * delta_t) - std::sin(motion.theta));
+      motion.y += v / yaw_rate * (std::cos(motion.theta) - std::cos(motion.theta + yaw_rate * delta_t));
+    } else {
+      motion.x += v * delta_t * std::cos(motion.theta);
+      motion.y += v * delta_t * std::sin(motion.theta);
+    }
+    motion.theta += yaw_rate * delta_t;
+  }
+  return motion;
+}
+
 /**
  * Computes the error (euclidean distance) between ground truth and particle filter data
  * @param (gt_x, gt_y, gt_theta) x, y and theta of ground truth
@@ -97,4 +124,91 @@ inline std::string vec_to_string(std::vector<T> v) {
   return s;
 }
 
+/*
+ * Writes a value in host byte order to a binary stream
+ */
+template <class T>
+inline void write_pod(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/*
+ * Reads a value in host byte order from a binary stream
+ * @output false if the stream ended
+ */
+template <class T>
+inline bool read_pod(std::istream& in, T& value) {
+  return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+/*
+ * Bytes left in a binary stream, to bound sizes read from it before allocating
+ * @output remaining bytes, or the largest value if the stream cannot seek
+ */
+inline uint64_t stream_remaining(std::istream& in) {
+  std::istream::pos_type pos = in.tellg();
+  if(pos == std::istream::pos_type(-1) || !in.seekg(0, std::ios::end)) {
+    in.clear();
+    return UINT64_MAX;
+  }
+  std::istream::pos_type end = in.tellg();
+  in.seekg(pos);
+  return end >= pos ? static_cast<uint64_t>(end - pos) : 0;
+}
+
+/*
+ * Monotonic timestamp in nanoseconds
+ */
+inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Default filter configuration used with the simulator
+ */
+inline filter_config_t default_filter_config() {
+  filter_config_t config;
+  // Time elapsed between measurements [sec]
+  config.delta_t = 0.1;
+  // Sensor range [m]
+  config.sensor_range = 50;
+  // GPS measurement uncertainty [x [m], y [m], theta [rad]]
+  config.sigma_pos[0] = 0.3;
+  config.sigma_pos[1] = 0.3;
+  config.sigma_pos[2] = 0.01;
+  // Landmark measurement uncertainty [x [m], y [m]]
+  config.sigma_landmark[0] = 0.3;
+  config.sigma_landmark[1] = 0.3;
+  // number of particles
+  config.num_particles = 100;
+  return config;
+}
+
+/*
+ * Matches a command line argument of the form --name=value
+ * @param arg command line argument
+ * @param name flag name without leading dashes
+ * @param value set to the text after '=' on a match
+ * @output true if the argument is the given flag
+ */
+inline bool parse_flag(const std::string& arg, const std::string& name, std::string& value) {
+  std::string prefix = "--" + name + "=";
+  if(arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+/*
+ * Path of an executable installed next to the running one
+ * @param argv0 path the running executable was started with
+ * @param name file name of the other executable
+ */
+inline std::string sibling_executable(const std::string& argv0, const std::string& name) {
+  size_t slash = argv0.find_last_of('/');
+  return (slash == std::string::npos ? std::string(".") : argv0.substr(0, slash)) + "/" + name;
+}
+
 #endif
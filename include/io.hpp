@@ -5,17 +5,29 @@
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <mutex>
 #include <functional>
 #include <uWS/uWS.h>
 #include "json.h"
 
 #include "types.hpp"
 #include "helpers.hpp"
+#include "session.hpp"
+#include "telemetry_log.hpp"
 
-// callback function definition
-// takes observations and control data
-typedef std::function< particle_t(double sense_x, double sense_y, double sense_theta,
-  double prev_velocity, double prev_yawrate, std::vector<landmark_t> observations) > ProcessCb;
+// pose sent to the simulator
+enum class PoseReport {
+  BEST,   // highest weight particle
+  MEAN    // weighted mean of all particles
+};
+
+// session factory definition
+// creates a new localization session for every simulator connection,
+// client is the vehicle id of the connection (see SimIO::clientId)
+typedef std::function< std::unique_ptr<Session>(int id, const std::string& client) > SessionFactory;
 
 /*
  * Interface to simulator
@@ -24,11 +36,11 @@ class SimIO {
 public:
   /*
    * Constructor
-   * Creates uWebSocket object and defines all event handlers
    * @param port - port number for simulator uWebSocket
-   * @param cb callback for processing function
+   * @param num_threads number of event-loop threads sharing the port
+   * @param factory creates a session per connection
    */
-  SimIO(int port, ProcessCb cb);
+  SimIO(int port, int num_threads, SessionFactory factory);
 
   /*
    * Destructor
@@ -36,12 +48,109 @@ public:
   ~SimIO() = default;
 
   /*
-   * Initializes connection to simulator and blocks it until simulator is closed.
-   * event handling for simulator
+   * Starts one uWebSocket hub per thread and blocks until all of them exit.
+   * Connections are distributed across hubs by the kernel (SO_REUSEPORT).
    */
   void run();
 
+  /*
+   * Records every incoming telemetry frame to a log
+   * @param recorder log writer, must outlive the server. nullptr disables recording
+   */
+  void setRecorder(TelemetryWriter* recorder) {
+    recorder_ = recorder;
+  }
+
+  /*
+   * Coalesces telemetry frames that queue up on a connection: all frames read
+   * in one event loop iteration are processed together (Session::processBacklog)
+   * and answered once for the newest frame.
+   * @param on true to coalesce, false to process and answer every frame
+   */
+  void setCoalescing(bool on) {
+    coalesce_ = on;
+  }
+
+  /*
+   * Selects the pose sent as best_particle_x/y/theta. Associations are always
+   * those of the best particle, the covariance always that of the mean.
+   * @param report best particle (default) or weighted mean
+   */
+  void setReport(PoseReport report) {
+    report_ = report;
+  }
+
+  /*
+   * Checkpoints the sessions of all open connections (Session::checkpoint),
+   * e.g. at shutdown while the hubs are still running.
+   */
+  void checkpointSessions();
+
 private:
+  // per connection state, the websocket's user data
+  struct connection_t {
+    uWS::WebSocket<uWS::SERVER> ws;
+    std::unique_ptr<Session> session;
+    std::vector<telemetry_t> pending;   // frames waiting to be processed, oldest first
+    uint64_t pending_recv_ns;           // receive time of the oldest pending frame [ns]
+  };
+
+  // per hub state for coalescing
+  struct hub_t {
+    SimIO* io;
+    uS::Timer* timer;                   // drains the pending frames after the current reads
+    std::vector<connection_t*> ready;   // connections with pending frames
+  };
+
+  /*
+   * Creates a hub, defines all event handlers and runs its event loop.
+   * Called once per thread.
+   */
+  void serve();
+
+  /*
+   * Parses a telemetry event
+   * @param data event data
+   * @param session_id session the frame is recorded for
+   * @param recv_ns time the message was received [ns]
+   */
+  telemetry_t parseTelemetry(const nlohmann::json& data, int session_id, uint64_t recv_ns);
+
+  /*
+   * Answers a frame with the session's estimate
+   * @param recv_ns time the (oldest answered) message was received [ns]
+   */
+  void sendResult(uWS::WebSocket<uWS::SERVER> ws, const frame_result_t& result, uint64_t recv_ns);
+
+  /*
+   * Processes the pending frames of all ready connections of a hub, timer callback
+   */
+  static void drain(uS::Timer* timer);
+
+  /*
+   * Logs an error of a connection and closes it, the other connections keep running
+   * @param e error raised while handling a message of the connection
+   */
+  void fail(hub_t& hub, uWS::WebSocket<uWS::SERVER> ws, const std::exception& e);
+
+  /*
+   * Processes the pending frames of a connection together and answers the newest
+   */
+  void processPending(connection_t& connection);
+
+  /*
+   * Parses an odometry event, moves the particles and answers with the mean pose.
+   * Event data: "velocity" [m/s], "yawrate" [rad/s], "delta_t" [s] since the previous sample
+   * @param recv_ns time the message was received [ns]
+   */
+  void handleOdometry(connection_t& connection, const nlohmann::json& data, uint64_t recv_ns);
+
+  /*
+   * returns the vehicle id a connection was opened with (ws://host:port/path?vehicle=<id>),
+   * "default" if none was given, e.g. by the simulator
+   */
+  static std::string clientId(uWS::HttpRequest req);
+
   /*
    * Checks if the SocketIO event has JSON data.
    * If there is data the JSON object in string format will be returned,
@@ -49,14 +158,30 @@ private:
    */
   std::string hasData(std::string s);
 
-  // uWS object
-  uWS::Hub h_;
-
   // connection port
   int port_;
 
-  // processing callback
-  ProcessCb callbackFunc_;
+  // number of event-loop threads
+  int num_threads_;
+
+  // session factory
+  SessionFactory factory_;
+
+  // id of the next session
+  std::atomic<int> next_session_id_;
+
+  // optional telemetry recorder
+  TelemetryWriter* recorder_;
+
+  // coalesce queued frames
+  bool coalesce_;
+
+  // reported pose
+  PoseReport report_;
+
+  // sessions of the open connections of all hubs
+  std::mutex sessions_mutex_;
+  std::vector<Session*> sessions_;
 };
 
   #endif
@@ -0,0 +1,119 @@
+#ifndef ISLAND_H
+#define ISLAND_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "types.hpp"
+
+// island filter settings
+struct island_config_t {
+  int islands;               // worker processes, each with its share of the particles
+  double exchange_fraction;  // share of an island's particles migrating to the next island
+  int exchange_interval;     // frames between migrations
+  std::string worker;        // island_worker executable
+  std::string map_file;      // map the workers load
+};
+
+/*
+ * returns the default island settings
+ * @param islands number of worker processes
+ * @param worker island_worker executable
+ * @param map_file map the workers load
+ */
+inline island_config_t default_island_config(int islands, const std::string& worker, const std::string& map_file) {
+  return island_config_t{islands, 0.05, 10, worker, map_file};
+}
+
+/*
+ * Coordinator of a particle filter split over worker processes (islands).
+ * Every island runs a complete session on its share of the particles and
+ * reports its weighted moments; the coordinator merges them into one
+ * estimate, weighting islands by their total weight, and reports the best
+ * particle of all islands. Every exchange_interval frames the highest
+ * weighted particles of each island replace the lowest weighted ones of the
+ * next island (ring), so islands that lost track recover.
+ *
+ * Workers are island_worker processes connected over Unix socket pairs;
+ * they exit when the coordinator closes its end.
+ */
+class IslandCoordinator {
+public:
+  /*
+   * Constructor
+   * Starts the workers. Throws std::runtime_error if one cannot be started
+   * or an update deadline is given, since islands cut off at different
+   * observations would weight their particles on different scales.
+   * @param config filter configuration, num_particles is split over the islands
+   * @param islands island settings
+   * @param update_deadline_ns weight update deadline of the workers [ns], 0 for none
+   * @param update_interval iterations per weight update of the workers
+   */
+  IslandCoordinator(const filter_config_t& config, const island_config_t& islands,
+                    uint64_t update_deadline_ns, int update_interval);
+
+  /*
+   * Destructor
+   * Closes the connections and waits for the workers to exit.
+   */
+  ~IslandCoordinator();
+
+  IslandCoordinator(const IslandCoordinator&) = delete;
+  IslandCoordinator& operator=(const IslandCoordinator&) = delete;
+
+  /*
+   * Runs one filter iteration on all islands, see Session::processBacklog.
+   * Throws std::runtime_error if a worker failed.
+   * @param frames consecutive frames, oldest first, at least one
+   * @param count number of frames
+   * @param recv_ns receive time of the oldest frame [ns], 0 for now
+   * @output merged result, best_index counts through the islands in order
+   */
+  frame_result_t process(const telemetry_t* frames, size_t count, uint64_t recv_ns);
+
+  /*
+   * Moves the particles of all islands by an odometry sample, see Session::predictOnly
+   * @param odometry motion since the previous odometry sample or frame
+   * @output merged pose estimate
+   */
+  pose_estimate_t predictOnly(const odometry_t& odometry);
+
+private:
+  struct worker_t {
+    pid_t pid;                        // worker process
+    int fd;                           // coordinator end of the socket pair
+    size_t num_particles;             // particles of the island
+    std::vector<particle_t> arrivals; // immigrants sent with the next frame
+  };
+
+  /*
+   * Starts the workers and sends them their configuration
+   */
+  void start(const filter_config_t& config, uint64_t update_deadline_ns, int update_interval);
+
+  /*
+   * Closes the connections and waits for the workers to exit
+   */
+  void stop();
+
+  /*
+   * Merges the island estimates into one, weighting islands by their total weight
+   */
+  pose_estimate_t merge(const std::vector<pose_estimate_t>& estimates) const;
+
+  std::vector<worker_t> workers_;
+  island_config_t config_;
+  uint64_t frames_;
+};
+
+/*
+ * Runs an island worker: reads its configuration and then frames from the
+ * coordinator until the connection closes.
+ * @param fd worker end of the socket pair
+ * @param map_file map to load
+ * @output exit code
+ */
+int run_island_worker(int fd, const std::string& map_file);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef LANDMARK_MAP_H
+#define LANDMARK_MAP_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "types.hpp"
+
+/*
+ * Read-only structure-of-arrays view of a landmark map with a uniform grid index.
+ * Landmarks are stored sorted by grid cell, so the landmarks of cell c are
+ * [cell_start[c], cell_start[c+1]). The arrays are owned elsewhere
+ * (LandmarkMap, a memory mapped file, ...).
+ */
+struct map_view_t {
+  uint32_t count;               // number of landmarks
+  const int32_t* id;            // landmark ids
+  const double* x;              // x-positions
+  const double* y;              // y-positions
+
+  double min_x, min_y;          // lower corner of the landmark bounds (grid origin)
+  double max_x, max_y;          // upper corner of the landmark bounds
+  double cell_size;             // edge length of a grid cell [m]
+  uint32_t cols, rows;          // grid dimensions
+  const uint32_t* cell_start;   // cols * rows + 1 offsets into the landmark arrays
+
+  /*
+   * Calls f(index) for every landmark within range of (px, py)
+   * @param (px, py) query position
+   * @param range search radius [m]
+   */
+  template <class F>
+  void for_each_in_range(double px, double py, double range, F f) const {
+    if(count == 0) {
+      return;
+    }
+    int c0 = cell_col(px - range), c1 = cell_col(px + range);
+    int r0 = cell_row(py - range), r1 = cell_row(py + range);
+    double range2 = range * range;
+    for(int r=r0; r<=r1; r++) {
+      for(int c=c0; c<=c1; c++) {
+        uint32_t cell = r * cols + c;
+        for(uint32_t i=cell_start[cell]; i<cell_start[cell+1]; i++) {
+          double dx = x[i] - px;
+          double dy = y[i] - py;
+          if(dx * dx + dy * dy <= range2) {
+            f(i);
+          }
+        }
+      }
+    }
+  }
+
+  /*
+   * Grid column of an x-position, clamped to the grid
+   */
+  int cell_col(double px) const {
+    double c = std::floor((px - min_x) / cell_size);
+    return static_cast<int>(std::min(std::max(c, 0.0), cols - 1.0));
+  }
+
+  /*
+   * Grid row of a y-position, clamped to the grid
+   */
+  int cell_row(double py) const {
+    double r = std::floor((py - min_y) / cell_size);
+    return static_cast<int>(std::min(std::max(r, 0.0), rows - 1.0));
+  }
+
+  /*
+   * returns landmark i as landmark_t
+   */
+  landmark_t landmark(uint32_t i) const {
+    return landmark_t{id[i], x[i], y[i]};
+  }
+};
+
+/*
+ * Landmark map held in memory, built from a list of landmarks.
+ */
+class LandmarkMap {
+public:
+  // default grid cell size [m]
+  static constexpr double DEFAULT_CELL_SIZE = 25.0;
+
+  /*
+   * Constructor
+   * Builds the structure-of-arrays layout and grid index.
+   * @param landmarks map landmarks
+   * @param cell_size grid cell size [m]
+   */
+  explicit LandmarkMap(const std::vector<landmark_t>& landmarks, double cell_size = DEFAULT_CELL_SIZE);
+
+  // the view points into this object, so it can't be copied
+  LandmarkMap(const LandmarkMap&) = delete;
+  LandmarkMap& operator=(const LandmarkMap&) = delete;
+
+  /*
+   * returns a view of the map, valid for the lifetime of this object
+   */
+  const map_view_t& view() const {
+    return view_;
+  }
+
+private:
+  std::vector<int32_t> id_;
+  std::vector<double> x_;
+  std::vector<double> y_;
+  std::vector<uint32_t> cell_start_;
+
+  map_view_t view_;
+};
+
+#endif
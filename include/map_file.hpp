@@ -0,0 +1,184 @@
+#ifndef MAP_FILE_H
+#define MAP_FILE_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "landmark_map.hpp"
+#include "tiled_map.hpp"
+
+/*
+ * Binary map image
+ *
+ * A map image is the header below followed by 64 byte aligned sections
+ * (host byte order), all referenced by byte offset from the start of the image:
+ *   int32  id[count]
+ *   double x[count], y[count]
+ *   uint32 cell_start[cols * rows + 1]
+ * The same image is used for map files and shared memory segments,
+ * so it can be used in place without any parsing or copying.
+ */
+struct map_header_t {
+  char magic[8];                // "PFMAP\0\0\0"
+  uint32_t version;             // MAP_FORMAT_VERSION
+  uint32_t count;               // number of landmarks
+  double min_x, min_y;          // landmark bounds
+  double max_x, max_y;
+  double cell_size;             // grid cell size [m]
+  uint32_t cols, rows;          // grid dimensions
+  uint64_t id_offset;           // section offsets [bytes]
+  uint64_t x_offset;
+  uint64_t y_offset;
+  uint64_t cell_start_offset;
+  uint64_t size;                // total image size [bytes]
+};
+
+// current version of the binary map format
+const uint32_t MAP_FORMAT_VERSION = 1;
+
+/*
+ * returns the image size needed for a map
+ * @param view map to store
+ */
+size_t map_image_size(const map_view_t& view);
+
+/*
+ * Serializes a map into a memory buffer
+ * @param view map to store
+ * @param buffer destination of at least map_image_size(view) bytes, 8 byte aligned
+ */
+void write_map_image(const map_view_t& view, void* buffer);
+
+/*
+ * Creates a view on a map image without copying, validating the header and
+ * the grid index (cell starts non-decreasing up to the landmark count).
+ * Throws std::runtime_error if the image is invalid.
+ * @param data start of the image
+ * @param size size of the image [bytes]
+ */
+map_view_t parse_map_image(const void* data, size_t size);
+
+/*
+ * Writes a map to a binary map file
+ * @param filename destination path
+ * @param view map to store
+ */
+void write_map_file(const std::string& filename, const map_view_t& view);
+
+/*
+ * Writes a map as a C++ header with constexpr arrays in the binary map
+ * layout and an embedded_map_view() function returning a view on them,
+ * so a binary built with it needs no map file (cmake -DEMBED_MAP=...).
+ * Throws std::runtime_error for empty maps or if the file cannot be written.
+ * @param filename destination path
+ * @param view map to store
+ * @param source name of the map the header is generated from, for its comment
+ */
+void write_map_header(const std::string& filename, const map_view_t& view, const std::string& source);
+
+// prefix of map names that refer to POSIX shared memory segments, e.g. "shm:/pf_map"
+const char SHARED_MAP_PREFIX[] = "shm:";
+
+/*
+ * Publishes a map as a POSIX shared memory segment holding a map image.
+ * A segment of the same name is replaced; processes attached to it keep
+ * their copy. The magic is written last, so a process attaching while the
+ * map is written sees an invalid image instead of a partial one.
+ * Throws std::runtime_error on failure.
+ * @param name segment name, e.g. "/pf_map"
+ * @param view map to publish
+ */
+void publish_shared_map(const std::string& name, const map_view_t& view);
+
+/*
+ * Removes a published map, attached processes keep their mapping
+ * @param name segment name
+ */
+void unlink_shared_map(const std::string& name);
+
+/*
+ * Binary map file or shared memory segment ("shm:/name", see
+ * publish_shared_map) mapped read-only into memory.
+ * Loading is O(1) in the map size and pages are shared between processes.
+ */
+class MappedMap {
+public:
+  /*
+   * Constructor
+   * @param filename binary map file created by map_compiler or shared memory name with SHARED_MAP_PREFIX
+   */
+  explicit MappedMap(const std::string& filename);
+
+  /*
+   * Destructor
+   * Unmaps the file.
+   */
+  ~MappedMap();
+
+  MappedMap(const MappedMap&) = delete;
+  MappedMap& operator=(const MappedMap&) = delete;
+
+  /*
+   * returns a view of the map, valid for the lifetime of this object
+   */
+  const map_view_t& view() const {
+    return view_;
+  }
+
+private:
+  // mapped file
+  void* data_;
+  size_t size_;
+
+  map_view_t view_;
+};
+
+/*
+ * Loads a map from a binary map file (*.bin), a tiled map file (*.tiles),
+ * a published shared memory map (shm:/name) or a text map file and keeps
+ * it alive for the lifetime of this object.
+ */
+class MapSource {
+public:
+  // default memory cap for resident tiles of a tiled map [bytes]
+  static const size_t DEFAULT_TILE_CACHE = 64 << 20;
+
+  /*
+   * Constructor
+   * @param filename map file, the format is chosen by extension or the shm: prefix
+   * @param tile_cache memory cap for resident tiles of a tiled map [bytes]
+   */
+  explicit MapSource(const std::string& filename, size_t tile_cache = DEFAULT_TILE_CACHE);
+
+  /*
+   * Constructor
+   * Uses a map whose arrays have static storage, e.g. embedded_map_view().
+   * @param view map view, its arrays must outlive this object
+   */
+  explicit MapSource(const map_view_t& view);
+
+  /*
+   * returns a view of the map, empty for tiled maps
+   */
+  const map_view_t& view() const;
+
+  /*
+   * returns the tiled map, nullptr if the map is not tiled
+   */
+  TiledMap* tiled() const {
+    return tiled_.get();
+  }
+
+private:
+  // at most one of mapped_ and memory_ is set, embedded_ is used if neither is
+  std::unique_ptr<MappedMap> mapped_;
+  std::unique_ptr<LandmarkMap> memory_;
+  map_view_t embedded_;
+
+  // streamed map, memory_ is empty in this case
+  std::unique_ptr<TiledMap> tiled_;
+};
+
+#endif
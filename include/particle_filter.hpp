@@ -5,9 +5,57 @@
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <iostream>
 #include "json.h"
 
 #include "types.hpp"
+#include "landmark_map.hpp"
+#include "thread_pool.hpp"
+
+// resampling algorithm
+enum class Resampler {
+  WHEEL,       // resampling wheel, serial
+  SYSTEMATIC,  // systematic resampling over a parallel prefix sum of the weights
+  METROPOLIS   // independent Metropolis chains per offspring, needs no weight sum
+};
+
+/*
+ * Parses a resampler name (wheel, systematic or metropolis)
+ * @param name resampler name
+ * @param resampler parsed resampler
+ * @output false for unknown names
+ */
+inline bool parse_resampler(const std::string& name, Resampler& resampler) {
+  if(name == "wheel") {
+    resampler = Resampler::WHEEL;
+  } else if(name == "systematic") {
+    resampler = Resampler::SYSTEMATIC;
+  } else if(name == "metropolis") {
+    resampler = Resampler::METROPOLIS;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// KLD-sampling: particle count bound from the histogram bins the particles occupy
+struct kld_config_t {
+  double epsilon;     // bound on the KL divergence between the particle set and the posterior
+  double z;           // upper 1 - delta quantile of the standard normal distribution
+  double bin_size;    // histogram bin edge [m]
+  double bin_angle;   // histogram bin angle [rad]
+  int min_particles;  // bounds of the particle count
+  int max_particles;
+};
+
+/*
+ * returns KLD-sampling settings with epsilon 0.05, delta 0.01 and 0.5 m x 0.5 m x 10 deg bins
+ * @param min_particles lower bound of the particle count
+ * @param max_particles upper bound of the particle count
+ */
+inline kld_config_t default_kld_config(int min_particles, int max_particles) {
+  return kld_config_t{0.05, 2.326, 0.5, 10 * M_PI / 180, min_particles, max_particles};
+}
 
 class ParticleFilter {
  public:
@@ -16,7 +64,8 @@ class ParticleFilter {
    * @param num_particles Number of particles
    */
   explicit ParticleFilter(int num_particles) :
-    num_particles_(num_particles), is_initialized_(false) {}
+    num_particles_(num_particles), is_initialized_(false), associations_{{}, {}, {}, 0, 0, 0}, pool_(nullptr),
+    resampler_(Resampler::WHEEL) {}
 
   /*
    * Destructor
@@ -34,6 +83,14 @@ class ParticleFilter {
    */
   void init(double x, double y, double theta, double std[]);
 
+  /**
+   * initGlobal Initializes particles uniformly over a region with uniform
+   *   headings, for localization without a position fix.
+   * @param region Region the vehicle is in, e.g. the map bounds
+   * @param num_particles Number of particles
+   */
+  void initGlobal(const bbox_t& region, int num_particles);
+
   /**
    * prediction Predicts the state for the next time step
    *   using the process model.
@@ -45,6 +102,26 @@ class ParticleFilter {
    */
   void prediction(double delta_t, double velocity, double yaw_rate, double std[]);
 
+  /**
+   * estimate returns the best particle index, the weight sum, the weighted
+   *   mean pose (circular mean of the headings) and its covariance from a
+   *   single pass over the particles, spread over the thread pool if set.
+   *   The sums run over fixed chunks merged in order, so the result is the
+   *   same for any thread count. Heading deviations are taken relative to the first particle, so the
+   *   covariance assumes the headings span less than half a turn.
+   */
+  pose_estimate_t estimate() const;
+
+  /**
+   * predictMotion Moves every particle by a displacement given in its own
+   *   vehicle frame, e.g. the composition of several controls.
+   * @param motion Displacement [x [m], y [m], theta [rad]]
+   * @param std_pos[] Array of dimension 3, noise per time step [standard deviation of x [m],
+   *   standard deviation of y [m], standard deviation of yaw [rad]]
+   * @param steps Number of time steps the motion covers, the noise grows with their square root
+   */
+  void predictMotion(const pose_t& motion, double std[], size_t steps);
+
   /**
    * dataAssociation Finds which observations correspond to which landmarks
    *   (by using a nearest-neighbors data association).
@@ -61,22 +138,101 @@ class ParticleFilter {
    * @param std_landmark[] Array of dimension 2
    *   [Landmark measurement uncertainty [x [m], y [m]]]
    * @param observations Vector of landmark observations
-   * @param map Vector containing map landmarks
+   * @param map Map landmarks with grid index
    */
   void updateWeights(double sensor_range, double std_landmark[],
                      const std::vector<landmark_t> &observations,
-                     const std::vector<landmark_t> &map_landmarks);
+                     const map_view_t &map);
+
+  /**
+   * updateWeightsAnytime Updates the weights like updateWeights, but stops at
+   *   a deadline. Observations are used nearest first, each one for all particles
+   *   in chunks, so all particles are always weighted by the same observations;
+   *   an observation the deadline interrupts is discarded. Weights are
+   *   accumulated as logarithms and scaled so the best particle has weight 1.
+   * @param sensor_range Range [m] of sensor
+   * @param std_landmark[] Array of dimension 2
+   *   [Landmark measurement uncertainty [x [m], y [m]]]
+   * @param observations Vector of landmark observations
+   * @param map Map landmarks with grid index
+   * @param deadline_ns Steady clock time to stop at [ns] (see now_ns)
+   * @output Number of observations used
+   */
+  size_t updateWeightsAnytime(double sensor_range, double std_landmark[],
+                              const std::vector<landmark_t> &observations,
+                              const map_view_t &map, uint64_t deadline_ns);
+
+  /**
+   * updateWeightsTwoStage Updates the weights like updateWeights in two stages:
+   *   all particles are weighted by the nearest coarse_observations, then only
+   *   blocks holding one of the best fine_fraction of the particles by that
+   *   coarse weight are weighted by the remaining observations. The other
+   *   particles get their coarse log weight scaled by the ratio of all
+   *   observations to the coarse ones and only the associations of the
+   *   coarse observations.
+   * @param sensor_range Range [m] of sensor
+   * @param std_landmark[] Array of dimension 2
+   *   [Landmark measurement uncertainty [x [m], y [m]]]
+   * @param observations Vector of landmark observations
+   * @param map Map landmarks with grid index
+   * @param coarse_observations Observations of the coarse stage
+   * @param fine_fraction Share of the particles the fine stage is run for at least
+   * @output Number of particles weighted by all observations
+   */
+  size_t updateWeightsTwoStage(double sensor_range, double std_landmark[],
+                               const std::vector<landmark_t> &observations,
+                               const map_view_t &map, size_t coarse_observations,
+                               double fine_fraction);
 
   /**
    * resamples from the updated set of particles to form
-   *   the new set of particles.
+   *   the new set of particles with the configured resampler.
+   *   The systematic and Metropolis resamplers run on the thread pool
+   *   if set; their results do not depend on its thread count.
    */
   void resample();
 
+  /**
+   * Selects the resampling algorithm.
+   * @param resampler Resampler, WHEEL by default
+   */
+  void setResampler(Resampler resampler) {
+    resampler_ = resampler;
+  }
+
   /**
    * returns the best particle from the filter
    */
-  particle_t get_best_particle();
+  particle_t get_best_particle() const;
+
+  /**
+   * returns a particle with the associations of its last weight update
+   * @param index Particle index, e.g. pose_estimate_t::best_index
+   */
+  particle_t particle(size_t index) const;
+
+  /**
+   * returns the ancestor of every particle, its index before the last resample
+   */
+  const std::vector<uint32_t>& ancestors() const {
+    return ancestors_;
+  }
+
+  /**
+   * returns the bounding box of all particle positions
+   */
+  bbox_t bounds() const;
+
+  /**
+   * kldParticles returns the particle count KLD-sampling bounds the error of
+   *   the current particles with: the count for which the KL divergence between
+   *   the particle set and the posterior stays below epsilon with probability
+   *   1 - delta, given the number of occupied (x, y, theta) histogram bins.
+   *   Very large regions get coarser bins to keep the histogram small.
+   * @param config KLD-sampling settings
+   * @output particle count within [min_particles, max_particles]
+   */
+  int kldParticles(const kld_config_t& config) const;
 
   /**
    * calculates weighted error for particles
@@ -84,6 +240,63 @@ class ParticleFilter {
    */
   double weighted_error(double gt_x, double gt_y, double gt_theta);
 
+  // format version of save, 2 adds the heading cos/sin of every particle
+  static const uint32_t STATE_VERSION = 2;
+
+  /**
+   * Serializes the complete filter state (particles with their cached heading
+   *   cos/sin and random generator) to a binary stream, so a restored filter
+   *   continues identically.
+   * @param out binary output stream
+   */
+  void save(std::ostream& out) const;
+
+  /**
+   * Restores a filter state written by save.
+   *   Version 1 states have no heading cos/sin, it is recomputed from the
+   *   headings, so such a filter only continues approximately.
+   *   Throws std::runtime_error on malformed input.
+   * @param in binary input stream
+   * @param version format version of the state
+   */
+  void load(std::istream& in, uint32_t version = STATE_VERSION);
+
+  /**
+   * emigrants returns the highest weighted particles, without associations.
+   * @param count Number of particles, at most all
+   */
+  std::vector<particle_t> emigrants(size_t count) const;
+
+  /**
+   * immigrate replaces the lowest weighted particles by the given ones.
+   * @param particles Particles from another filter, at most as many as this one has
+   */
+  void immigrate(const std::vector<particle_t>& particles);
+
+  /**
+   * Seeds the random generator, e.g. to decorrelate filters of one run.
+   * @param seed Seed
+   */
+  void setSeed(uint32_t seed) {
+    gen_.seed(seed);
+  }
+
+  /**
+   * Changes the number of particles, resample draws the new number.
+   * @param num_particles Number of particles
+   */
+  void setNumParticles(int num_particles) {
+    num_particles_ = num_particles;
+  }
+
+  /**
+   * Spreads the weight update over a thread pool.
+   * @param pool Thread pool, nullptr to update on the calling thread
+   */
+  void setThreadPool(ThreadPool* pool) {
+    pool_ = pool;
+  }
+
   /**
    * initialized returns whether particle filter is initialized yet or not.
    */
@@ -92,17 +305,131 @@ class ParticleFilter {
   }
 
  private:
+  // particles weighted together by the vectorized update, one vector register of doubles
+#if defined(__AVX512F__)
+  static const size_t LANES = 8;
+#elif defined(__AVX__)
+  static const size_t LANES = 4;
+#else
+  static const size_t LANES = 2;
+#endif
+
+  /**
+   * buildCandidates Collects the landmarks the particles can observe:
+   *   the map is prefiltered once to the particles' bounding box inflated
+   *   by the sensor range, then the particles are grouped into grid clusters
+   *   and every cluster gets one candidate list covering all its members.
+   *   The members of a cluster are split into blocks of LANES particles
+   *   that are weighted together.
+   * @param sensor_range Range [m] of sensor
+   * @param map Map landmarks with grid index
+   */
+  void buildCandidates(double sensor_range, const map_view_t &map);
+
+  /**
+   * The resamplers draw the ancestor of every offspring into ancestors_,
+   *   resample gathers the offspring from them.
+   */
+  void resampleWheel();
+  void resampleSystematic();
+  void resampleMetropolis();
+
+  /**
+   * drawNoise Draws the prediction noise of every particle into noise_.
+   *   Large particle sets draw it in fixed blocks of particles with generators
+   *   seeded from gen_, in parallel on the thread pool if set, so it does
+   *   not depend on the thread count.
+   * @param std[] Standard deviation of x [m], y [m] and yaw [rad]
+   * @param scale Factor of the standard deviations
+   */
+  void drawNoise(const double std[], double scale);
+
+  /**
+   * resizeAssociations Prepares the association rows of all particles.
+   * @param stride Entries per row, the number of observations
+   */
+  void resizeAssociations(size_t stride);
+
+  /**
+   * forRanges Runs body over ranges of [0, count), on the thread pool if set.
+   */
+  void forRanges(size_t count, const std::function<void(size_t, size_t)>& body) const;
+
   // Number of particles to draw
   int num_particles_;
 
   // Flag, if filter is initialized
   bool is_initialized_;
 
-  // Set of current particles
-  std::vector<particle_t> particles_;
+  // particle state without its associations, the part resampling gathers
+  struct state_t {
+    int id;
+    double x;
+    double y;
+    double theta;
+    double cos_t;  // cos and sin of theta, kept up to date by rotation instead of trigonometric calls
+    double sin_t;
+    double weight;
+    uint32_t row;  // row of its associations, NO_ROW before the first weight update
+
+    /*
+     * Sets the heading and its cos and sin
+     */
+    void setHeading(double heading) {
+      theta = heading;
+      cos_t = std::cos(heading);
+      sin_t = std::sin(heading);
+    }
+  };
+  static const uint32_t NO_ROW = 0xffffffff;
+  // flag of rows that only hold the coarse entries of a two-stage update
+  static const uint32_t COARSE_ROW = 0x80000000;
+
+  // Set of current particles and the buffer resampling gathers into
+  std::vector<state_t> particles_;
+  std::vector<state_t> resampled_;
+
+  // associations of the last weight update, row r holds entries [r * stride, r * stride + count)
+  struct associations_t {
+    std::vector<int> ids;
+    std::vector<double> sense_x;
+    std::vector<double> sense_y;
+    size_t stride;  // entries per row, the number of observations
+    size_t count;   // entries used per row
+    size_t coarse;  // entries used by rows flagged COARSE_ROW
+  };
+  associations_t associations_;
 
   // generator for random distributions
   std::default_random_engine gen_;
+
+  // pool for the weight update, nullptr if single threaded
+  ThreadPool* pool_;
+
+  // resampling algorithm and ancestor of every offspring of the last resample
+  Resampler resampler_;
+  std::vector<uint32_t> ancestors_;
+
+  // resampler scratch, slice prefix sums or contiguous weights and slice seeds; grow only
+  std::vector<double> resample_weights_;
+  std::vector<uint32_t> resample_seeds_;
+
+  // prediction noise per particle [x, y, theta], reused between predictions
+  std::vector<double> noise_;
+
+  // landmark candidates shared by spatial clusters of particles, reused between updates
+  struct block_t {
+    uint32_t cluster;  // cluster of all particles in the block
+    uint32_t begin;    // members of the block are [begin, end)
+    uint32_t end;
+  };
+  struct candidates_t {
+    std::vector<landmark_t> landmarks;  // candidates of all clusters, concatenated
+    std::vector<uint32_t> start;        // candidates of cluster c are [start[c], start[c+1])
+    std::vector<uint32_t> members;      // particle indices ordered by cluster
+    std::vector<block_t> blocks;        // blocks of at most LANES members of one cluster
+  };
+  candidates_t candidates_;
 };
 
 
@@ -0,0 +1,86 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <string>
+#include <cstdint>
+
+// hardware events counted per stage
+enum class PerfEvent : int {
+  CYCLES,
+  INSTRUCTIONS,
+  L1D_MISSES,     // L1 data cache read misses
+  LLC_MISSES,     // last level cache misses
+  BRANCH_MISSES,
+  COUNT
+};
+
+// counter values, indexed by PerfEvent
+struct perf_sample_t {
+  uint64_t values[static_cast<int>(PerfEvent::COUNT)];
+};
+
+/*
+ * Hardware performance counters of the calling thread (Linux perf_event_open).
+ * Events the kernel or CPU doesn't provide are left out; if none can be
+ * opened (no permission, virtual machine, other OS) the object is unavailable
+ * and reads return zeros.
+ */
+class PerfCounters {
+public:
+  /*
+   * Constructor
+   * Opens a counter group on the calling thread, user space only.
+   */
+  PerfCounters();
+
+  /*
+   * Destructor
+   * Closes the counters.
+   */
+  ~PerfCounters();
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  /*
+   * returns whether at least one counter is running
+   */
+  bool available() const {
+    return leader_ >= 0;
+  }
+
+  /*
+   * returns whether an event is counted
+   */
+  bool counting(PerfEvent event) const {
+    return slot_[static_cast<int>(event)] >= 0;
+  }
+
+  /*
+   * returns why counters are unavailable, empty if they are available
+   */
+  const std::string& error() const {
+    return error_;
+  }
+
+  /*
+   * Reads the running totals of all events with a single system call
+   * @param sample receives the totals, zero for events not counted
+   */
+  void read(perf_sample_t& sample) const;
+
+private:
+  // group leader file descriptor, -1 if unavailable
+  int leader_;
+
+  // file descriptors of the events, -1 if not counted
+  int fds_[static_cast<int>(PerfEvent::COUNT)];
+
+  // position of each event in the group read, -1 if not counted
+  int slot_[static_cast<int>(PerfEvent::COUNT)];
+  int num_slots_;
+
+  std::string error_;
+};
+
+#endif
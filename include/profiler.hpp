@@ -0,0 +1,286 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+
+#include "helpers.hpp"
+#include "trace.hpp"
+#include "perf_counters.hpp"
+
+// timed stages of a frame
+enum class Stage : int {
+  PARSE,      // message parsing
+  INIT,       // filter initialization
+  PREDICT,    // prediction step
+  UPDATE,     // weight update
+  RESAMPLE,   // resampling
+  BEST,       // best particle / pose estimate
+  SERIALIZE,  // reply serialization
+  SEND,       // reply send
+  FRAME,      // whole frame
+  ODOMETRY,   // predict-only odometry step
+  CHECKPOINT, // filter checkpoint write
+  COUNT
+};
+
+/*
+ * returns the name of a stage
+ */
+const char* stage_name(Stage stage);
+
+/*
+ * Log-linear latency histogram (HDR style) with ~3% relative precision
+ * covering the full 64 bit nanosecond range.
+ * Written by a single thread, readable concurrently from any thread.
+ */
+class LatencyHistogram {
+public:
+  // linear sub-buckets per power of two
+  static const int SUB_BUCKET_BITS = 5;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+  LatencyHistogram();
+
+  /*
+   * Records a value. Only one thread may record into a histogram.
+   * @param ns latency [ns]
+   */
+  void record(uint64_t ns) {
+    std::atomic<uint64_t>& c = counts_[bucket(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if(ns > max_.load(std::memory_order_relaxed)) {
+      max_.store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  /*
+   * Removes all values. Not safe while another thread records.
+   */
+  void clear();
+
+  /*
+   * Adds the counts of another histogram
+   */
+  void merge(const LatencyHistogram& other);
+
+  /*
+   * returns the number of recorded values
+   */
+  uint64_t count() const;
+
+  /*
+   * returns the value at a quantile, accurate to the bucket width [ns]
+   * @param q quantile in [0, 1]
+   */
+  uint64_t quantile(double q) const;
+
+  /*
+   * returns the largest recorded value [ns]
+   */
+  uint64_t max() const {
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * returns the bucket index of a value
+   */
+  static int bucket(uint64_t ns) {
+    if(ns < 2 * SUB_BUCKETS) {
+      return static_cast<int>(ns);
+    }
+    int exponent = 63 - __builtin_clzll(ns) - SUB_BUCKET_BITS;
+    return exponent * SUB_BUCKETS + static_cast<int>(ns >> exponent);
+  }
+
+  /*
+   * returns the upper bound of the values in a bucket
+   */
+  static uint64_t bucket_value(int index);
+
+private:
+  std::atomic<uint64_t> counts_[NUM_BUCKETS];
+  std::atomic<uint64_t> max_;
+};
+
+// hardware counter totals of a stage
+struct stage_counters_t {
+  uint64_t calls;         // number of timed stage executions
+  perf_sample_t totals;   // summed counter deltas
+};
+
+/*
+ * Process-wide stage latency statistics.
+ * Every thread records into its own set of histograms, so recording is
+ * lock free and costs two clock reads and a counter increment.
+ */
+class Profiler {
+public:
+  /*
+   * Turns recording on or off (off by default)
+   */
+  static void enable(bool on);
+
+  /*
+   * returns whether recording is on
+   */
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * returns whether stages are timed, for histograms or tracing
+   */
+  static bool active() {
+    return enabled() || Tracer::enabled();
+  }
+
+  /*
+   * Records a stage latency for the calling thread
+   * @param stage timed stage
+   * @param ns latency [ns]
+   */
+  static void record(Stage stage, uint64_t ns);
+
+  /*
+   * Records a stage into the histograms and the trace, whichever are on
+   * @param stage timed stage
+   * @param begin_ns start time [ns]
+   * @param end_ns end time [ns]
+   */
+  static void span(Stage stage, uint64_t begin_ns, uint64_t end_ns) {
+    if(enabled()) {
+      record(stage, end_ns - begin_ns);
+    }
+    if(Tracer::enabled()) {
+      Tracer::record(stage_name(stage), begin_ns, end_ns);
+    }
+  }
+
+  /*
+   * Turns hardware counter sampling per stage on or off (off by default).
+   * Each sample costs two read system calls, so this is for profiling runs only.
+   */
+  static void enable_counters(bool on);
+
+  /*
+   * returns whether hardware counters are sampled
+   */
+  static bool counters_enabled() {
+    return counters_enabled_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * returns why hardware counters are unavailable on the calling thread, empty if they work
+   */
+  static std::string counters_error();
+
+  /*
+   * Reads the hardware counters of the calling thread
+   */
+  static void read_counters(perf_sample_t& sample);
+
+  /*
+   * Adds the counter deltas since a sample to a stage
+   * @param stage timed stage
+   * @param start counters at the beginning of the stage
+   */
+  static void add_counters(Stage stage, const perf_sample_t& start);
+
+  /*
+   * returns the counter totals of a stage, merged over all threads
+   */
+  static stage_counters_t counters(Stage stage);
+
+  /*
+   * Clears histograms and counter totals of all threads.
+   * Only call while no other thread is recording.
+   */
+  static void reset();
+
+  /*
+   * Writes count, p50, p99, p99.9 and max of every stage, merged over all threads
+   * @param out output stream
+   */
+  static void report(std::ostream& out);
+
+  /*
+   * Writes IPC and counter events per particle of every stage. Counters only
+   * see the threads the stages ran on, not thread pool workers.
+   * @param out output stream
+   * @param num_particles particles processed per stage execution, 0 to only
+   *   write IPC, e.g. when a thread pool did part of the work
+   */
+  static void report_counters(std::ostream& out, int num_particles);
+
+  /*
+   * Starts a background thread reporting to stdout every period
+   * @param period_s reporting period [s]
+   */
+  static void report_periodically(double period_s);
+
+private:
+  static std::atomic<bool> enabled_;
+  static std::atomic<bool> counters_enabled_;
+};
+
+/*
+ * Records the lifetime of a scope as a stage latency and trace span,
+ * and its hardware counters when enabled.
+ */
+class ScopedStage {
+public:
+  /*
+   * Constructor
+   * @param stage timed stage
+   * @param elapsed_ns if set, receives the stage latency even when profiling is off
+   */
+  explicit ScopedStage(Stage stage, uint64_t* elapsed_ns = nullptr) :
+    stage_(stage), start_ns_(0), elapsed_ns_(elapsed_ns), counting_(Profiler::counters_enabled()),
+    tracing_(Tracer::enabled()), outer_scope_(nullptr) {
+    if(tracing_) {
+      // names the thread pool chunks run for the stage
+      outer_scope_ = Tracer::enter(stage_name(stage));
+    }
+    if(counting_) {
+      Profiler::read_counters(start_counters_);
+    }
+    if(elapsed_ns_ || Profiler::active()) {
+      start_ns_ = now_ns();
+    }
+  }
+
+  ~ScopedStage() {
+    if(start_ns_) {
+      uint64_t end_ns = now_ns();
+      if(elapsed_ns_) {
+        *elapsed_ns_ = end_ns - start_ns_;
+      }
+      if(Profiler::active()) {
+        Profiler::span(stage_, start_ns_, end_ns);
+      }
+    }
+    if(counting_) {
+      Profiler::add_counters(stage_, start_counters_);
+    }
+    if(tracing_) {
+      Tracer::leave(outer_scope_);
+    }
+  }
+
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+  Stage stage_;
+  uint64_t start_ns_;
+  uint64_t* elapsed_ns_;
+  bool counting_;
+  perf_sample_t start_counters_;
+  bool tracing_;
+  const char* outer_scope_;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <vector>
+#include <cstdint>
+
+#include "types.hpp"
+
+// parameters of a synthetic scenario
+struct scenario_config_t {
+  uint32_t seed;              // random seed, equal seeds give equal scenarios
+  int num_landmarks;          // landmarks of a generated map
+  int num_observations;       // target observations per frame
+  int num_frames;             // frames to generate
+  double delta_t;             // time between frames [s]
+  double sensor_range;        // sensor range [m]
+  double velocity;            // vehicle speed [m/s]
+  double sigma_pos[3];        // GPS noise [x [m], y [m], theta [rad]]
+  double sigma_landmark[2];   // observation noise [x [m], y [m]]
+  double sigma_control[2];    // control noise [velocity [m/s], yaw rate [rad/s]]
+};
+
+// generated scenario
+struct scenario_t {
+  std::vector<landmark_t> map;          // landmark map
+  std::vector<pose_t> ground_truth;     // true pose per frame
+  std::vector<telemetry_t> frames;      // simulated telemetry per frame
+};
+
+/*
+ * returns a scenario configuration matching the simulator
+ * @param config filter configuration
+ */
+scenario_config_t default_scenario_config(const filter_config_t& config);
+
+/*
+ * Generates a random landmark map. The map area is chosen so that
+ * num_observations landmarks are in sensor range on average.
+ * @param config scenario parameters
+ */
+std::vector<landmark_t> generate_map(const scenario_config_t& config);
+
+/*
+ * Generates a deterministic scenario on a map: a ground truth trajectory
+ * that stays within the map bounds, noisy controls, noisy GPS and noisy
+ * observations of the nearest landmarks within sensor range.
+ * @param config scenario parameters
+ * @param map landmark map
+ */
+scenario_t generate_scenario(const scenario_config_t& config, const std::vector<landmark_t>& map);
+
+#endif
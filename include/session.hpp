@@ -0,0 +1,325 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <mutex>
+
+#include "types.hpp"
+#include "particle_filter.hpp"
+#include "landmark_map.hpp"
+#include "map_file.hpp"
+#include "flight_recorder.hpp"
+#include "auto_tuner.hpp"
+#include "thread_pool.hpp"
+#include "island.hpp"
+
+// filter checkpoint settings
+struct checkpoint_config_t {
+  std::string path;   // checkpoint file, the client id is appended
+  uint64_t interval;  // frames between checkpoints, 0 to only write them on request and at destruction
+};
+
+// global localization settings
+struct global_config_t {
+  int num_particles;  // particles spread over the map on the first frame
+  kld_config_t kld;   // particle count reduction as the posterior concentrates
+};
+
+/*
+ * Localization session for a single simulator connection.
+ * Every session owns its filter and configuration, so concurrent
+ * clients never share state. The map is shared read-only.
+ */
+class Session {
+public:
+  /*
+   * Constructor
+   * @param id unique session id
+   * @param config filter configuration (copied)
+   * @param map landmark map, its storage must outlive the session
+   */
+  Session(int id, const filter_config_t& config, const map_view_t& map);
+
+  /*
+   * Constructor
+   * Streams the landmarks around the vehicle if the map is tiled.
+   * @param id unique session id
+   * @param config filter configuration (copied)
+   * @param map map source, must outlive the session
+   */
+  Session(int id, const filter_config_t& config, const MapSource& map);
+
+  /*
+   * Destructor
+   * Writes a last checkpoint if enabled.
+   */
+  ~Session();
+
+  /*
+   * Runs one filter iteration on a telemetry frame.
+   * Initializes from GPS on the first frame, predicts on the following ones.
+   * @param frame telemetry received from the simulator
+   * @param recv_ns receive time of the frame [ns] the update deadline counts from, 0 for now
+   * @output best particle after resampling and whether the update was cut short
+   */
+  frame_result_t process(const telemetry_t& frame, uint64_t recv_ns = 0);
+
+  /*
+   * Runs one filter iteration for frames that queued up while the session was busy.
+   * The particles are moved once by the composition of all controls and only the
+   * newest observations are used, so stale frames cost no update or resample.
+   * @param frames consecutive frames, oldest first, at least one
+   * @param recv_ns receive time of the oldest frame [ns], 0 for now
+   * @output result for the newest frame
+   */
+  frame_result_t processBacklog(const std::vector<telemetry_t>& frames, uint64_t recv_ns = 0);
+
+  /*
+   * Moves the particles by an odometry sample without touching weights or
+   * resampling, for pose reports between landmark frames. The next frame
+   * skips its own prediction since its motion has been applied already.
+   * Throws std::runtime_error for a non-positive or non-finite delta_t or non-finite motion.
+   * @param odometry motion since the previous odometry sample or frame
+   * @output pose estimate, zero before the first frame
+   */
+  pose_estimate_t predictOnly(const odometry_t& odometry);
+
+  /*
+   * Runs the weight update and resampling only on every Kth iteration,
+   * the iterations in between only predict
+   * @param interval K, 1 updates on every iteration
+   */
+  void setUpdateInterval(int interval) {
+    update_interval_ = interval;
+  }
+
+  /*
+   * Bounds the weight update: once the deadline after the frame was received
+   * has passed, the remaining observations are skipped and the frame is partial.
+   * Resampling and the reply still follow the deadline.
+   * @param deadline_ns update deadline relative to frame receipt [ns], 0 for none
+   */
+  void setUpdateDeadline(uint64_t deadline_ns) {
+    update_deadline_ns_ = deadline_ns;
+  }
+
+  /*
+   * Weights the particles in two stages (ParticleFilter::updateWeightsTwoStage):
+   * all by the nearest observations, only the best share of them by all.
+   * An update deadline takes precedence.
+   * @param coarse_observations observations of the coarse stage, 0 to weight all particles by all observations
+   * @param fine_fraction share of the particles weighted by all observations
+   */
+  void setTwoStageUpdate(size_t coarse_observations, double fine_fraction) {
+    coarse_observations_ = coarse_observations;
+    fine_fraction_ = fine_fraction;
+  }
+
+  /*
+   * Keeps the recent frames and dumps them when a frame is slow
+   * @param config recorder settings
+   */
+  void enableFlightRecorder(const flight_config_t& config);
+
+  /*
+   * Adjusts the particle count to keep the p99 frame latency within a budget
+   * @param config latency budget settings
+   */
+  void enableAutoTune(const tuner_config_t& config);
+
+  /*
+   * Spreads the weight update over a thread pool
+   * @param pool thread pool, must outlive the session; nullptr for none
+   */
+  void setThreadPool(ThreadPool* pool) {
+    filter_.setThreadPool(pool);
+  }
+
+  /*
+   * Selects the resampling algorithm
+   * @param resampler resampler, the parallel ones use the thread pool
+   */
+  void setResampler(Resampler resampler) {
+    filter_.setResampler(resampler);
+  }
+
+  /*
+   * Splits the particles over island worker processes, which are started
+   * with the first frame using the update settings of that time. The flight
+   * recorder, auto-tuning and the thread pool only apply to the local filter,
+   * which is unused then.
+   * @param config island settings
+   */
+  void enableIslands(const island_config_t& config) {
+    island_config_.reset(new island_config_t(config));
+  }
+
+  /*
+   * Localizes without a position fix: the first frame spreads the particles
+   * uniformly over the map bounds, ignoring GPS, and after every resample the
+   * particle count follows the KLD-sampling bound, so it shrinks towards
+   * min_particles as the posterior concentrates. Needs an in-memory map and
+   * does not apply to island sessions, callers check both up front.
+   * @param config global localization settings
+   */
+  void enableGlobalLocalization(const global_config_t& config) {
+    global_.reset(new global_config_t(config));
+  }
+
+  /*
+   * Seeds the filter's random generator
+   * @param seed seed
+   */
+  void setSeed(uint32_t seed) {
+    filter_.setSeed(seed);
+  }
+
+  /*
+   * returns copies of the highest weighted particles, see ParticleFilter::emigrants
+   * @param count number of particles
+   */
+  std::vector<particle_t> emigrants(size_t count) const {
+    return filter_.emigrants(count);
+  }
+
+  /*
+   * Replaces the lowest weighted particles, see ParticleFilter::immigrate
+   * @param particles particles from another filter
+   */
+  void immigrate(const std::vector<particle_t>& particles) {
+    filter_.immigrate(particles);
+  }
+
+  /*
+   * Replaces the filter state, e.g. from a flight recorder dump
+   * @param state serialized filter state (ParticleFilter::save)
+   * @param version format version of the state
+   */
+  void restore(const std::string& state, uint32_t version = ParticleFilter::STATE_VERSION);
+
+  /*
+   * Checkpoints the filter to <path>.<client> every interval frames and
+   * at destruction, and restores it from there if the file exists, so a
+   * restarted server continues with the converged particles instead of
+   * initializing from GPS. Unless global localization is enabled, a restored
+   * filter whose mean is more than 5 sigma_pos off the position
+   * fix of the first frame is initialized from GPS after all, e.g. when the
+   * vehicle moved while the server was down. A checkpoint is a telemetry log
+   * with a single state record; it is written and synced to a temporary file
+   * first and renamed, so a crash never leaves a truncated one. Island
+   * sessions are not checkpointed.
+   * @param config checkpoint settings
+   * @param client id of the vehicle, stable across connections and restarts
+   * @output true if the filter was restored
+   */
+  bool enableCheckpoints(const checkpoint_config_t& config, const std::string& client);
+
+  /*
+   * Writes a checkpoint now, e.g. at shutdown. Safe to call from another
+   * thread than the one processing frames; does nothing if disabled.
+   * Throws std::runtime_error if the checkpoint cannot be written.
+   */
+  void checkpoint();
+
+  /*
+   * returns the session id
+   */
+  int id() const {
+    return id_;
+  }
+
+private:
+  /*
+   * Filter iteration for the newest of count frames, see processBacklog
+   */
+  frame_result_t step(const telemetry_t* frames, size_t count, uint64_t recv_ns);
+
+  /*
+   * Completes an iteration: flight recorder and particle count control
+   * @param stage_ns stage latencies, indexed by Stage [ns]
+   * @param start_ns start of the iteration [ns], 0 if not timed
+   */
+  frame_result_t finish(const frame_result_t& result, const uint64_t stage_ns[], uint64_t start_ns);
+
+  /*
+   * Writes the checkpoint file, the caller holds mutex_
+   */
+  void writeCheckpoint();
+
+  /*
+   * returns true if the filter mean is within RESTORE_GATE sigma_pos of the position fix of a frame
+   */
+  bool nearFix(const telemetry_t& frame) const;
+
+  /*
+   * Loads the tiles around the particles into the working set
+   * and prefetches the tiles along the direction of travel.
+   */
+  void updateWorkingSet();
+
+  // session id
+  int id_;
+
+  // filter configuration
+  filter_config_t config_;
+
+  // shared landmark map
+  map_view_t map_;
+
+  // streamed map, nullptr if the whole map is in memory
+  TiledMap* tiled_;
+
+  // landmarks of the tiles around the vehicle when streaming
+  std::unique_ptr<LandmarkMap> working_set_;
+
+  // region covered by the working set
+  bbox_t working_region_;
+
+  // center of the particles in the previous frame
+  double last_x_, last_y_;
+
+  // per-session particle filter
+  ParticleFilter filter_;
+
+  // weight update deadline after frame receipt [ns], 0 for none
+  uint64_t update_deadline_ns_;
+
+  // observations of the coarse update stage (0: single stage) and share of the particles refined
+  size_t coarse_observations_;
+  double fine_fraction_;
+
+  // iterations per weight update and iterations so far
+  int update_interval_;
+  uint64_t steps_;
+
+  // odometry moved the particles since the last frame
+  bool odometry_applied_;
+
+  // slow-frame recorder, nullptr if disabled
+  std::unique_ptr<FlightRecorder> recorder_;
+
+  // particle count control, nullptr if disabled
+  std::unique_ptr<LatencyGovernor> governor_;
+
+  // island settings and their coordinator once started, nullptr if disabled
+  std::unique_ptr<island_config_t> island_config_;
+  std::unique_ptr<IslandCoordinator> islands_;
+
+  // global localization settings, nullptr to initialize from GPS
+  std::unique_ptr<global_config_t> global_;
+
+  // checkpoint settings, nullptr if disabled, its file and frames since the last checkpoint
+  std::unique_ptr<checkpoint_config_t> checkpoint_;
+  std::string checkpoint_file_;
+  uint64_t frames_since_checkpoint_;
+
+  // the filter was restored from a checkpoint and not yet checked against a position fix
+  bool check_restore_;
+
+  // serializes the filter iterations with checkpoints requested from other threads
+  std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef TELEMETRY_LOG_H
+#define TELEMETRY_LOG_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+
+#include "types.hpp"
+
+/*
+ * Binary telemetry log
+ *
+ * File layout (host byte order):
+ *   header: char magic[4] = "PFTL", uint32 version
+ *   records, each starting with uint8 record type and uint32 session id:
+ *   frame:  uint64 receive time [ns],
+ *           double sense_x, sense_y, sense_theta, prev_velocity, prev_yawrate,
+ *           uint32 observation count, count x (float x, float y)
+ *   state:  int32 num_particles, double delta_t, sensor_range, sigma_pos[3], sigma_landmark[2],
+ *           uint64 size, serialized filter state (ParticleFilter::save)
+ *   timing: uint32 stage count, count x uint64 stage latency [ns] of the preceding frame
+ *   odometry: uint64 receive time [ns], double velocity, yaw_rate, delta_t
+ *   backlog: uint32 count, the following count frame records were processed together
+ *
+ * Version 1 logs have no record type and only frame records. The filter
+ * states of version 2 logs are ParticleFilter::save version 1, those of
+ * version 3 and later logs version 2. Backlog records exist from version 4.
+ * Observations are stored as floats since that is the precision
+ * they are parsed with from the simulator.
+ * A state record restores the session's filter, so the frames following it
+ * replay deterministically (flight recorder dumps start with one).
+ */
+
+// kind of a log record
+enum class RecordType : uint8_t {
+  FRAME = 1,    // telemetry frame
+  STATE = 2,    // filter configuration and state
+  TIMING = 3,   // stage latencies of the preceding frame
+  ODOMETRY = 4, // odometry sample
+  BACKLOG = 5   // marks frames processed together (Session::processBacklog)
+};
+
+// single log record
+struct telemetry_record_t {
+  RecordType type;
+  int session_id;                 // session the record belongs to
+  uint64_t recv_ns;               // FRAME, ODOMETRY: monotonic receive time [ns]
+  telemetry_t frame;              // FRAME: telemetry data
+  odometry_t odometry;            // ODOMETRY: odometry sample
+  filter_config_t config;         // STATE: filter configuration
+  std::string state;              // STATE: serialized filter state
+  uint32_t state_version;         // STATE: format version of the filter state (ParticleFilter::load)
+  std::vector<uint64_t> stage_ns; // TIMING: latency per Stage [ns]
+  uint32_t backlog;               // BACKLOG: number of the following frames processed together
+};
+
+/*
+ * returns a frame record
+ */
+inline telemetry_record_t frame_record(int session_id, uint64_t recv_ns, const telemetry_t& frame) {
+  telemetry_record_t record;
+  record.type = RecordType::FRAME;
+  record.session_id = session_id;
+  record.recv_ns = recv_ns;
+  record.frame = frame;
+  return record;
+}
+
+/*
+ * returns a backlog record
+ */
+inline telemetry_record_t backlog_record(int session_id, uint32_t count) {
+  telemetry_record_t record;
+  record.type = RecordType::BACKLOG;
+  record.session_id = session_id;
+  record.backlog = count;
+  return record;
+}
+
+/*
+ * returns an odometry record
+ */
+inline telemetry_record_t odometry_record(int session_id, uint64_t recv_ns, const odometry_t& odometry) {
+  telemetry_record_t record;
+  record.type = RecordType::ODOMETRY;
+  record.session_id = session_id;
+  record.recv_ns = recv_ns;
+  record.odometry = odometry;
+  return record;
+}
+
+/*
+ * Appends telemetry frames to a log file. Safe to share between threads.
+ */
+class TelemetryWriter {
+public:
+  /*
+   * Constructor
+   * Creates the log file and writes the header.
+   * @param filename path of the log file
+   */
+  explicit TelemetryWriter(const std::string& filename);
+
+  /*
+   * Appends a record and flushes it, so the log survives the server being killed.
+   * @param record record to write
+   */
+  void write(const telemetry_record_t& record);
+
+private:
+  // output file
+  std::ofstream out_;
+
+  // serializes writes from multiple threads
+  std::mutex mutex_;
+};
+
+/*
+ * Reads telemetry frames back from a log file.
+ */
+class TelemetryReader {
+public:
+  /*
+   * Constructor
+   * Opens the log file and validates the header.
+   * @param filename path of the log file
+   */
+  explicit TelemetryReader(const std::string& filename);
+
+  /*
+   * Reads the next record
+   * @param record filled with the record
+   * @output false at the end of the log
+   */
+  bool next(telemetry_record_t& record);
+
+private:
+  // input file
+  std::ifstream in_;
+
+  // format version of the file
+  uint32_t version_;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+/*
+ * Fixed size pool of worker threads for data parallel loops.
+ * The calling thread takes part in its own loops, so a pool of size 1
+ * has no workers and runs everything inline. Loops from several threads
+ * (e.g. sessions on different event loops) can share a pool.
+ */
+class ThreadPool {
+public:
+  /*
+   * Constructor
+   * @param num_threads threads working on a loop, including the caller
+   */
+  explicit ThreadPool(int num_threads);
+
+  /*
+   * Destructor
+   * Joins the workers, no loop may be running.
+   */
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /*
+   * returns the number of threads working on a loop, including the caller
+   */
+  int size() const {
+    return static_cast<int>(workers_.size()) + 1;
+  }
+
+  /*
+   * Runs body over [0, count) in chunks and returns when all chunks are done.
+   * When tracing, every chunk is a span named after the loop, or else after
+   * the caller's innermost span (e.g. its filter stage).
+   * @param count number of items
+   * @param body called with [begin, end) ranges of items, concurrently
+   * @param name trace span name of the chunks, a string literal
+   */
+  void parallel_for(size_t count, const std::function<void(size_t, size_t)>& body, const char* name = nullptr);
+
+private:
+  // a running loop, lives on the stack of the calling thread
+  struct batch_t {
+    const std::function<void(size_t, size_t)>* body;
+    const char* name;   // trace span name of the chunks
+    size_t count;
+    size_t chunk;       // items per chunk
+    size_t chunks;      // number of chunks
+    size_t next;        // next unclaimed chunk
+    size_t done;        // finished chunks
+  };
+
+  /*
+   * Claims the next chunk of the first queued batch, requires mutex_
+   * @param batch receives the batch of the chunk
+   * @param chunk receives the chunk index
+   * @output false if no chunk is left
+   */
+  bool claim(batch_t*& batch, size_t& chunk);
+
+  /*
+   * Runs a claimed chunk and marks it done
+   */
+  void run(batch_t& batch, size_t chunk);
+
+  void work();
+
+  std::vector<std::thread> workers_;
+
+  // batches with unclaimed chunks, oldest first
+  std::deque<batch_t*> queue_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;   // chunks queued or stopping
+  std::condition_variable done_cv_;   // a chunk finished
+  bool stopping_;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef TILED_MAP_H
+#define TILED_MAP_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+#include "types.hpp"
+
+/*
+ * Tiled map file
+ *
+ * Layout (host byte order):
+ *   header:    tiled_map_header_t
+ *   directory: cols * rows tile entries (row major)
+ *   tiles:     landmark records of each tile
+ */
+struct tiled_map_header_t {
+  char magic[8];        // "PFTILES\0"
+  uint32_t version;     // TILED_MAP_FORMAT_VERSION
+  uint32_t cols, rows;  // tile grid dimensions
+  uint32_t count;       // total number of landmarks
+  double origin_x;      // lower corner of tile (0, 0)
+  double origin_y;
+  double tile_size;     // edge length of a tile [m]
+};
+
+// directory entry of a single tile
+struct tile_entry_t {
+  uint64_t offset;      // file offset of the landmark records
+  uint32_t count;       // number of landmarks in the tile
+  uint32_t reserved;
+};
+
+// landmark record stored in a tile
+struct tile_landmark_t {
+  int32_t id;
+  int32_t reserved;
+  double x;
+  double y;
+};
+
+// current version of the tiled map format
+const uint32_t TILED_MAP_FORMAT_VERSION = 1;
+
+/*
+ * Writes landmarks as a tiled map file
+ * @param filename destination path
+ * @param landmarks map landmarks
+ * @param tile_size edge length of a tile [m]
+ */
+void write_tiled_map(const std::string& filename, const std::vector<landmark_t>& landmarks, double tile_size);
+
+/*
+ * Map store that streams tiles from disk on demand.
+ * Only the tiles around the vehicles are resident, recently unused tiles
+ * are evicted once the resident size exceeds the memory cap, so memory
+ * depends on the sensor range instead of the map size.
+ * Tiles expected to be needed soon are loaded by a background thread.
+ * All methods are thread safe.
+ */
+class TiledMap {
+public:
+  /*
+   * Constructor
+   * Opens the tile file and starts the prefetch thread.
+   * @param filename tiled map file
+   * @param memory_cap maximum resident tile data [bytes]
+   */
+  TiledMap(const std::string& filename, size_t memory_cap);
+
+  /*
+   * Destructor
+   * Stops the prefetch thread and closes the file.
+   */
+  ~TiledMap();
+
+  TiledMap(const TiledMap&) = delete;
+  TiledMap& operator=(const TiledMap&) = delete;
+
+  /*
+   * Collects the landmarks of all tiles overlapping a region,
+   * loading missing tiles synchronously.
+   * @param region area of interest
+   * @param landmarks receives the landmarks (appended)
+   * @output region the returned landmarks are complete for: the returned
+   *   tiles, extended to infinity on the sides the map ends at
+   */
+  bbox_t query(const bbox_t& region, std::vector<landmark_t>& landmarks);
+
+  /*
+   * Queues the tiles overlapping a region for background loading.
+   * @param region area expected to be queried soon
+   */
+  void prefetch(const bbox_t& region);
+
+  /*
+   * returns the size of the resident tile data [bytes]
+   */
+  size_t resident_bytes();
+
+private:
+  struct tile_t {
+    std::vector<tile_landmark_t> landmarks;
+    std::list<uint32_t>::iterator lru;  // position in lru_
+  };
+
+  /*
+   * Tile indices overlapping a region
+   */
+  std::vector<uint32_t> tiles_in(const bbox_t& region) const;
+
+  /*
+   * Reads a tile from disk, without holding the lock
+   */
+  std::vector<tile_landmark_t> load(uint32_t tile) const;
+
+  /*
+   * Adds a loaded tile to the cache and evicts least recently used tiles. Requires the lock.
+   */
+  void insert(uint32_t tile, std::vector<tile_landmark_t>&& landmarks);
+
+  /*
+   * Prefetch thread main loop
+   */
+  void prefetch_loop();
+
+  // tile file and its size [bytes]
+  int fd_;
+  uint64_t file_size_;
+  tiled_map_header_t header_;
+
+  // maximum resident tile data [bytes]
+  size_t memory_cap_;
+  size_t resident_bytes_;
+
+  // resident tiles, most recently used at the front of lru_
+  std::unordered_map<uint32_t, tile_t> tiles_;
+  std::list<uint32_t> lru_;
+
+  // tiles currently being loaded
+  std::unordered_set<uint32_t> loading_;
+
+  // prefetch queue
+  std::deque<uint32_t> queue_;
+  bool stop_;
+
+  std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::condition_variable loaded_cv_;
+  std::thread prefetcher_;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+#include "helpers.hpp"
+
+/*
+ * Chrome trace event export (loadable in Perfetto and chrome://tracing).
+ * Spans are appended to a ring buffer of the recording thread and written
+ * to the trace file by a background thread, so the hot path only stores
+ * three words. Spans are dropped if a ring overflows between two flushes.
+ */
+class Tracer {
+public:
+  /*
+   * Opens the trace file and starts the flush thread
+   * @param filename trace file (JSON array format)
+   */
+  static void start(const std::string& filename);
+
+  /*
+   * Flushes all pending spans, terminates the JSON array and closes the file
+   */
+  static void stop();
+
+  /*
+   * returns whether tracing is on
+   */
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Records a complete span for the calling thread
+   * @param name span name, must be a string literal (only the pointer is kept)
+   * @param begin_ns start time [ns]
+   * @param end_ns end time [ns]
+   */
+  static void record(const char* name, uint64_t begin_ns, uint64_t end_ns);
+
+  /*
+   * returns the name of the innermost open span of the calling thread,
+   * nullptr if none or tracing is off
+   */
+  static const char* scope() {
+    return scope_;
+  }
+
+  /*
+   * Opens a span scope on the calling thread, see scope
+   * @param name span name, a string literal
+   * @output the enclosing scope, to be passed to leave
+   */
+  static const char* enter(const char* name) {
+    const char* outer = scope_;
+    scope_ = name;
+    return outer;
+  }
+
+  /*
+   * Closes the innermost span scope of the calling thread
+   * @param outer scope returned by the matching enter
+   */
+  static void leave(const char* outer) {
+    scope_ = outer;
+  }
+
+private:
+  static std::atomic<bool> enabled_;
+  static thread_local const char* scope_;
+};
+
+/*
+ * Records the lifetime of a scope as a trace span.
+ */
+class TraceSpan {
+public:
+  explicit TraceSpan(const char* name) :
+    name_(name), outer_(nullptr), start_ns_(0) {
+    if(Tracer::enabled()) {
+      outer_ = Tracer::enter(name);
+      start_ns_ = now_ns();
+    }
+  }
+
+  ~TraceSpan() {
+    if(start_ns_) {
+      Tracer::record(name_, start_ns_, now_ns());
+      Tracer::leave(outer_);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  const char* name_;
+  const char* outer_;
+  uint64_t start_ns_;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define TYPES_H
 
 #include <vector>
+#include <cstddef>
 
 // represents a single landmark
 struct landmark_t {
@@ -22,6 +23,63 @@ struct particle_t {
   std::vector<double> sense_y;
 };
 
+// vehicle pose
+struct pose_t {
+  double x;
+  double y;
+  double theta;
+};
+
+// axis aligned bounding box
+struct bbox_t {
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+};
+
+// single telemetry frame received from the simulator
+struct telemetry_t {
+  double sense_x;        // noisy GPS x-position (used for init)
+  double sense_y;        // noisy GPS y-position
+  double sense_theta;    // noisy GPS heading
+  double prev_velocity;  // control velocity from previous to current step
+  double prev_yawrate;   // control yaw rate from previous to current step
+  std::vector<landmark_t> observations;  // noisy observations in vehicle coordinates
+};
+
+// odometry sample, published at a higher rate than telemetry frames
+struct odometry_t {
+  double velocity;       // velocity since the previous sample [m/s]
+  double yaw_rate;       // yaw rate since the previous sample [rad/s]
+  double delta_t;        // time since the previous sample [s]
+};
+
+// particle filter configuration, one copy per session
+struct filter_config_t {
+  int num_particles;        // number of particles
+  double delta_t;           // time elapsed between measurements [s]
+  double sensor_range;      // sensor range [m]
+  double sigma_pos[3];      // GPS measurement uncertainty [x [m], y [m], theta [rad]]
+  double sigma_landmark[2]; // landmark measurement uncertainty [x [m], y [m]]
+};
+
+// pose estimate of the particle set
+struct pose_estimate_t {
+  size_t best_index;        // particle with the highest weight
+  double best_weight;       // its weight
+  double weight_sum;        // sum of all weights
+  pose_t mean;              // weighted mean, circular mean of the headings
+  double covariance[9];     // weighted covariance of (x, y, theta), row major [m^2, m rad, rad^2]
+};
+
+// result of a filter iteration
+struct frame_result_t {
+  particle_t best;          // best particle after resampling
+  pose_estimate_t estimate; // mean and covariance after resampling
+  bool partial;             // the update hit its deadline before using all observations
+  size_t observations_used; // observations the weights are based on
+};
 
 
 #endif
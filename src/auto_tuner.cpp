@@ -0,0 +1,144 @@
+#include "auto_tuner.hpp"
+#include "session.hpp"
+#include "thread_pool.hpp"
+#include "helpers.hpp"
+
+#include <thread>
+#include <limits>
+#include <algorithm>
+
+namespace {
+
+// fraction of the budget aimed at, leaves room for jitter and other load
+const double HEADROOM = 0.8;
+// a thread count is only kept if it allows this many times more particles
+const double MIN_THREAD_GAIN = 1.1;
+// bisection stops at this relative precision of the particle count
+const double PRECISION = 0.1;
+// frames per governor window
+const size_t WINDOW = 100;
+
+// p99 of a latency sample [ns]
+uint64_t p99(std::vector<uint64_t>& samples) {
+  auto nth = samples.begin() + static_cast<size_t>(0.99 * (samples.size() - 1));
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+/*
+ * returns the p99 frame latency of a configuration, or the max of
+ * uint64_t as soon as more than 1% of the frames missed the target
+ */
+uint64_t measure(const filter_config_t& config, ThreadPool& pool, const SessionSetup& setup,
+                 const std::vector<telemetry_t>& frames, const map_view_t& map, uint64_t target_ns) {
+  Session session(0, config, map);
+  if(setup) {
+    setup(session);
+  }
+  session.setThreadPool(&pool);
+  std::vector<uint64_t> latencies;
+  size_t allowed_misses = frames.size() / 100;
+  size_t misses = 0;
+  for(auto const& frame : frames) {
+    uint64_t start_ns = now_ns();
+    session.process(frame);
+    uint64_t latency = now_ns() - start_ns;
+    // the first frame initializes, the budget applies to the steady state
+    if(&frame == &frames.front()) {
+      continue;
+    }
+    latencies.push_back(latency);
+    if(latency > target_ns && ++misses > allowed_misses) {
+      return std::numeric_limits<uint64_t>::max();
+    }
+  }
+  return latencies.empty() ? 0 : p99(latencies);
+}
+
+}
+
+tuner_config_t default_tuner_config(uint64_t budget_ns) {
+  tuner_config_t config;
+  config.budget_ns = budget_ns;
+  config.min_particles = 10;
+  config.max_particles = 1000000;
+  config.max_threads = std::max(1u, std::thread::hardware_concurrency());
+  return config;
+}
+
+tuning_t calibrate(const tuner_config_t& tuner, const filter_config_t& config,
+                   const std::vector<telemetry_t>& frames, const map_view_t& map, std::ostream* log,
+                   const SessionSetup& setup) {
+  uint64_t target_ns = static_cast<uint64_t>(tuner.budget_ns * HEADROOM);
+  tuning_t best{tuner.min_particles, 1, 0};
+  bool found = false;
+
+  for(int threads=1; threads<=tuner.max_threads; threads*=2) {
+    ThreadPool pool(threads);
+    filter_config_t c = config;
+
+    // particle counts known to pass and to fail (0: none yet)
+    int pass = 0, fail = 0;
+    uint64_t pass_p99 = 0;
+    auto attempt = [&](int n) {
+      c.num_particles = n;
+      uint64_t p = measure(c, pool, setup, frames, map, target_ns);
+      if(log) {
+        *log << "calibrate: " << threads << " threads, " << n << " particles: p99 ";
+        if(p == std::numeric_limits<uint64_t>::max()) {
+          *log << "over budget" << std::endl;
+        } else {
+          *log << p * 1e-3 << " us" << std::endl;
+        }
+      }
+      if(p <= target_ns) {
+        pass = n;
+        pass_p99 = p;
+      } else {
+        fail = n;
+      }
+    };
+
+    // grow geometrically from the best count so far, then bisect
+    int n = found ? best.num_particles : tuner.min_particles;
+    while(!fail && pass < tuner.max_particles) {
+      attempt(n);
+      n = std::min(n * 2, tuner.max_particles);
+    }
+    while(pass && fail && fail - pass > pass * PRECISION) {
+      attempt(pass + (fail - pass) / 2);
+    }
+
+    if(!pass || (found && pass < best.num_particles * MIN_THREAD_GAIN)) {
+      // more threads don't pay off, or not even the minimum fits
+      break;
+    }
+    best = tuning_t{pass, threads, pass_p99};
+    found = true;
+    if(pass >= tuner.max_particles) {
+      break;
+    }
+  }
+  return best;
+}
+
+LatencyGovernor::LatencyGovernor(const tuner_config_t& config) : config_(config) {
+  window_.reserve(WINDOW);
+}
+
+int LatencyGovernor::update(uint64_t frame_ns, int num_particles) {
+  window_.push_back(frame_ns);
+  if(window_.size() < WINDOW) {
+    return num_particles;
+  }
+  uint64_t p = std::max<uint64_t>(p99(window_), 1);
+  window_.clear();
+  if(p <= config_.budget_ns && p >= config_.budget_ns / 2) {
+    return num_particles;
+  }
+
+  // scale towards the target, at most by half or one and a half per window
+  double scale = std::min(1.5, std::max(0.5, config_.budget_ns * HEADROOM / p));
+  int n = static_cast<int>(num_particles * scale);
+  return std::min(config_.max_particles, std::max(config_.min_particles, n));
+}
@@ -0,0 +1,85 @@
+#include "flight_recorder.hpp"
+#include "telemetry_log.hpp"
+
+#include <sstream>
+
+FlightRecorder::FlightRecorder(int session_id, const flight_config_t& config) :
+  session_id_(session_id), config_(config), filter_config_(),
+  previous_index_(0), current_index_(0), frame_index_(0), last_dump_index_(0), dumped_(false) {
+  if(config_.frames == 0) {
+    config_.frames = 1;
+  }
+}
+
+void FlightRecorder::beginFrame(const ParticleFilter& filter, const filter_config_t& filter_config,
+                                const telemetry_t* frames, size_t count) {
+  filter_config_ = filter_config;
+
+  // rotate the snapshots and drop the frames before the older one
+  if(frame_index_ % config_.frames == 0) {
+    std::ostringstream state;
+    filter.save(state);
+    previous_state_.swap(current_state_);
+    previous_index_ = current_index_;
+    current_state_ = state.str();
+    current_index_ = frame_index_;
+    if(previous_state_.empty()) {
+      previous_index_ = current_index_;
+    }
+    while(!frames_.empty() && frames_.front().index < previous_index_) {
+      frames_.pop_front();
+    }
+  }
+
+  frames_.push_back(entry_t{frame_index_, std::vector<telemetry_t>(frames, frames + count), std::vector<uint64_t>()});
+  frame_index_++;
+}
+
+std::string FlightRecorder::endFrame(const uint64_t stage_ns[], uint64_t frame_ns) {
+  if(frames_.empty()) {
+    return std::string();
+  }
+  entry_t& entry = frames_.back();
+  entry.stage_ns.assign(stage_ns, stage_ns + static_cast<int>(Stage::COUNT));
+  entry.stage_ns[static_cast<int>(Stage::FRAME)] = frame_ns;
+
+  if(frame_ns < config_.threshold_ns || (dumped_ && entry.index - last_dump_index_ < config_.frames)) {
+    return std::string();
+  }
+  dumped_ = true;
+  last_dump_index_ = entry.index;
+  return dump();
+}
+
+std::string FlightRecorder::dump() const {
+  const entry_t& last = frames_.back();
+  std::string filename = config_.directory + "/flight-" + std::to_string(session_id_) +
+                         "-" + std::to_string(last.index) + ".tlog";
+  TelemetryWriter writer(filename);
+
+  // filter state before the oldest kept frame
+  telemetry_record_t record;
+  record.type = RecordType::STATE;
+  record.session_id = session_id_;
+  record.config = filter_config_;
+  record.state = previous_state_.empty() ? current_state_ : previous_state_;
+  writer.write(record);
+
+  // frames since, with their original latencies; receive times are paced at delta_t
+  for(auto const& entry : frames_) {
+    uint64_t recv_ns = static_cast<uint64_t>((entry.index - frames_.front().index) * filter_config_.delta_t * 1e9);
+    if(entry.frames.size() > 1) {
+      writer.write(backlog_record(session_id_, static_cast<uint32_t>(entry.frames.size())));
+    }
+    for(auto const& frame : entry.frames) {
+      writer.write(frame_record(session_id_, recv_ns, frame));
+    }
+
+    telemetry_record_t timing;
+    timing.type = RecordType::TIMING;
+    timing.session_id = session_id_;
+    timing.stage_ns = entry.stage_ns;
+    writer.write(timing);
+  }
+  return filename;
+}
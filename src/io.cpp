@@ -1,56 +1,80 @@
 #include "io.hpp"
+#include "profiler.hpp"
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+SimIO::SimIO(int port, int num_threads, SessionFactory factory) :
+  port_(port), num_threads_(std::max(num_threads, 1)), factory_(factory), next_session_id_(0),
+  recorder_(nullptr), coalesce_(false), report_(PoseReport::BEST) {}
+
+void SimIO::run() {
+  if(num_threads_ == 1) {
+    serve();
+    return;
+  }
+  // every thread runs its own hub listening on the same port
+  std::vector<std::thread> threads;
+  for(int i=0; i<num_threads_; i++) {
+    threads.emplace_back(&SimIO::serve, this);
+  }
+  for(auto& t : threads) {
+    t.join();
+  }
+}
+
+void SimIO::serve() {
+  uWS::Hub h;
+
+  // zero timeout timer, fires once the reads of the current loop iteration are handled
+  hub_t hub{this, new uS::Timer(h.getLoop()), std::vector<connection_t*>()};
+  hub.timer->setData(&hub);
 
-SimIO::SimIO(int port, ProcessCb cb) : port_(port), callbackFunc_(cb) {
   /*
    * Register event handlers for uWS
    */
-  h_.onMessage([&](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, uWS::OpCode opCode) {
+  h.onMessage([this, &hub](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, uWS::OpCode opCode) {
     // "42" at the start of the message means there's a websocket message event.
     // The 4 signifies a websocket message
     // The 2 signifies a websocket event
     if (length && length > 2 && data[0] == '4' && data[1] == '2') {
-      std::string s = hasData(std::string(data));
+      uint64_t recv_ns = now_ns();
+      std::string s = hasData(std::string(data, length));
 
       if(s != "") { // data available
-        // parse json
-        auto j = nlohmann::json::parse(s);
-        std::string event = j[0].get<std::string>();
-
-        if(event == "telemetry") {
-          // Sense noisy position data from the simulator (used for init)
-          double sense_x = std::stod(j[1]["sense_x"].get<std::string>());
-          double sense_y = std::stod(j[1]["sense_y"].get<std::string>());
-          double sense_theta = std::stod(j[1]["sense_theta"].get<std::string>());
-          // Predict the vehicle's next state from previous (noiseless control) data.
-          double previous_velocity = std::stod(j[1]["previous_velocity"].get<std::string>());
-          double previous_yawrate = std::stod(j[1]["previous_yawrate"].get<std::string>());
-          // noisy observation data from the simulator
-          std::vector<float> x_sense = string_to_vec(j[1]["sense_observations_x"]);
-          std::vector<float> y_sense = string_to_vec(j[1]["sense_observations_y"]);
-          assert(x_sense.size() == y_sense.size());
-          std::vector<landmark_t> noisy_observations;
-          for(size_t i = 0; i < x_sense.size(); ++i) {
-            landmark_t obs;
-            obs.x = x_sense[i];
-            obs.y = y_sense[i];
-            noisy_observations.push_back(obs);
-          }
+        connection_t* connection = static_cast<connection_t*>(ws.getUserData());
+        try {
+          // parse json
+          auto j = nlohmann::json::parse(s);
+          std::string event = j[0].get<std::string>();
 
-          // process
-          particle_t best_particle = callbackFunc_(sense_x, sense_y, sense_theta, previous_velocity, previous_yawrate, std::move(noisy_observations));
-
-          // send output
-          nlohmann::json msgJson;
-          msgJson["best_particle_x"] = best_particle.x;
-          msgJson["best_particle_y"] = best_particle.y;
-          msgJson["best_particle_theta"] = best_particle.theta;
-          // Optional message data used for debugging particle's sensing and associations
-          msgJson["best_particle_associations"] = vec_to_string(best_particle.associations);
-          msgJson["best_particle_sense_x"] = vec_to_string(best_particle.sense_x);
-          msgJson["best_particle_sense_y"] = vec_to_string(best_particle.sense_y);
-          auto msg = "42[\"best_particle\"," + msgJson.dump() + "]";
-          // std::cout << msg << std::endl;
-          ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+          if(event == "telemetry" && connection) {
+            telemetry_t frame = parseTelemetry(j[1], connection->session->id(), recv_ns);
+            if(!coalesce_) {
+              // process, the update deadline counts from the receive time
+              sendResult(ws, connection->session->process(frame, recv_ns), recv_ns);
+            } else {
+              if(connection->pending.empty()) {
+                connection->pending_recv_ns = recv_ns;
+                if(hub.ready.empty()) {
+                  hub.timer->start(drain, 0, 0);
+                }
+                hub.ready.push_back(connection);
+              }
+              connection->pending.push_back(std::move(frame));
+            }
+          } else if(event == "odometry" && connection) {
+            // frames queued before the sample have to move the particles first
+            if(!connection->pending.empty()) {
+              hub.ready.erase(std::find(hub.ready.begin(), hub.ready.end(), connection));
+              processPending(*connection);
+            }
+            handleOdometry(*connection, j[1], recv_ns);
+          }
+        } catch(std::exception& e) {
+          // malformed messages and failing sessions end only their own connection
+          fail(hub, ws, e);
         }
       } else {
         std::string msg = "42[\"manual\",{}]";
@@ -59,27 +83,200 @@ SimIO::SimIO(int port, ProcessCb cb) : port_(port), callbackFunc_(cb) {
     }
   });
 
-  h_.onConnection([](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
-    std::cout << "Connected!!!" << std::endl;
+  h.onConnection([this](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
+    // every connection gets its own session
+    std::unique_ptr<Session> session;
+    try {
+      session = factory_(next_session_id_++, clientId(req));
+    } catch(std::exception& e) {
+      // e.g. a corrupt checkpoint, the other connections keep running
+      std::cerr << e.what() << std::endl;
+      ws.close(1011);
+      return;
+    }
+    connection_t* connection = new connection_t{ws, std::move(session), std::vector<telemetry_t>(), 0};
+    std::cout << "Connected!!! session " << connection->session->id() << std::endl;
+    ws.setUserData(connection);
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    sessions_.push_back(connection->session.get());
   });
 
-  h_.onDisconnection([](uWS::WebSocket<uWS::SERVER> ws, int code,
+  h.onDisconnection([this, &hub](uWS::WebSocket<uWS::SERVER> ws, int code,
                          char *message, size_t length) {
+    connection_t* connection = static_cast<connection_t*>(ws.getUserData());
+    if(connection) {
+      std::cout << "Disconnected session " << connection->session->id() << std::endl;
+      hub.ready.erase(std::remove(hub.ready.begin(), hub.ready.end(), connection), hub.ready.end());
+      ws.setUserData(nullptr);
+      {
+        // waits for a running checkpoint of the session
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), connection->session.get()), sessions_.end());
+      }
+      delete connection;
+    }
     ws.close();
-    std::cout << "Disconnected" << std::endl;
   });
-}
 
-void SimIO::run() {
   // listen and wait for connection
-  if (h_.listen(port_)) {
+  int options = num_threads_ > 1 ? uS::ListenOptions::REUSE_PORT : 0;
+  if (h.listen(port_, nullptr, options)) {
     std::cout << "Listening to port " << port_ << std::endl;
   } else {
     std::cerr << "Failed to listen to port" << std::endl;
     return;
   }
   // endless loop until application exists
-  h_.run();
+  h.run();
+  hub.timer->close();
+}
+
+void SimIO::checkpointSessions() {
+  std::lock_guard<std::mutex> lock(sessions_mutex_);
+  for(Session* session : sessions_) {
+    try {
+      session->checkpoint();
+    } catch(std::runtime_error& e) {
+      std::cerr << "Session " << session->id() << ": " << e.what() << std::endl;
+    }
+  }
+}
+
+void SimIO::drain(uS::Timer* timer) {
+  hub_t& hub = *static_cast<hub_t*>(timer->getData());
+  timer->stop();
+  // sessions may receive new frames while sending, those wait for the next drain
+  std::vector<connection_t*> ready;
+  ready.swap(hub.ready);
+  for(connection_t* connection : ready) {
+    try {
+      hub.io->processPending(*connection);
+    } catch(std::exception& e) {
+      hub.io->fail(hub, connection->ws, e);
+    }
+  }
+}
+
+void SimIO::fail(hub_t& hub, uWS::WebSocket<uWS::SERVER> ws, const std::exception& e) {
+  connection_t* connection = static_cast<connection_t*>(ws.getUserData());
+  if(connection) {
+    std::cerr << "Session " << connection->session->id() << ": " << e.what() << std::endl;
+    // the session is destroyed on disconnection, its queued frames are dropped
+    hub.ready.erase(std::remove(hub.ready.begin(), hub.ready.end(), connection), hub.ready.end());
+    connection->pending.clear();
+  } else {
+    std::cerr << e.what() << std::endl;
+  }
+  ws.close(1011);
+}
+
+void SimIO::processPending(connection_t& connection) {
+  std::vector<telemetry_t> frames;
+  frames.swap(connection.pending);
+  frame_result_t result = connection.session->processBacklog(frames, connection.pending_recv_ns);
+  sendResult(connection.ws, result, connection.pending_recv_ns);
+}
+
+void SimIO::handleOdometry(connection_t& connection, const nlohmann::json& data, uint64_t recv_ns) {
+  odometry_t odometry;
+  odometry.velocity = std::stod(data["velocity"].get<std::string>());
+  odometry.yaw_rate = std::stod(data["yawrate"].get<std::string>());
+  odometry.delta_t = std::stod(data["delta_t"].get<std::string>());
+  // rejects invalid samples before they are recorded
+  pose_estimate_t estimate = connection.session->predictOnly(odometry);
+  if(recorder_) {
+    recorder_->write(odometry_record(connection.session->id(), recv_ns, odometry));
+  }
+  nlohmann::json msgJson;
+  msgJson["x"] = estimate.mean.x;
+  msgJson["y"] = estimate.mean.y;
+  msgJson["theta"] = estimate.mean.theta;
+  msgJson["covariance"] = std::vector<double>(estimate.covariance, estimate.covariance + 9);
+  auto msg = "42[\"pose\"," + msgJson.dump() + "]";
+  connection.ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+}
+
+telemetry_t SimIO::parseTelemetry(const nlohmann::json& data, int session_id, uint64_t recv_ns) {
+  telemetry_t frame;
+  // Sense noisy position data from the simulator (used for init)
+  frame.sense_x = std::stod(data["sense_x"].get<std::string>());
+  frame.sense_y = std::stod(data["sense_y"].get<std::string>());
+  frame.sense_theta = std::stod(data["sense_theta"].get<std::string>());
+  // Predict the vehicle's next state from previous (noiseless control) data.
+  frame.prev_velocity = std::stod(data["previous_velocity"].get<std::string>());
+  frame.prev_yawrate = std::stod(data["previous_yawrate"].get<std::string>());
+  // noisy observation data from the simulator
+  std::vector<float> x_sense = string_to_vec(data["sense_observations_x"]);
+  std::vector<float> y_sense = string_to_vec(data["sense_observations_y"]);
+  assert(x_sense.size() == y_sense.size());
+  for(size_t i = 0; i < x_sense.size(); ++i) {
+    landmark_t obs;
+    obs.x = x_sense[i];
+    obs.y = y_sense[i];
+    frame.observations.push_back(obs);
+  }
+  if(Profiler::active()) {
+    Profiler::span(Stage::PARSE, recv_ns, now_ns());
+  }
+
+  if(recorder_) {
+    recorder_->write(frame_record(session_id, recv_ns, frame));
+  }
+  return frame;
+}
+
+void SimIO::sendResult(uWS::WebSocket<uWS::SERVER> ws, const frame_result_t& result, uint64_t recv_ns) {
+  const particle_t& best_particle = result.best;
+  bool profile = Profiler::active();
+
+  // send output
+  uint64_t serialize_ns = profile ? now_ns() : 0;
+  nlohmann::json msgJson;
+  if(report_ == PoseReport::MEAN) {
+    msgJson["best_particle_x"] = result.estimate.mean.x;
+    msgJson["best_particle_y"] = result.estimate.mean.y;
+    msgJson["best_particle_theta"] = result.estimate.mean.theta;
+  } else {
+    msgJson["best_particle_x"] = best_particle.x;
+    msgJson["best_particle_y"] = best_particle.y;
+    msgJson["best_particle_theta"] = best_particle.theta;
+  }
+  // covariance of the mean pose (x, y, theta), row major
+  msgJson["covariance"] = std::vector<double>(result.estimate.covariance, result.estimate.covariance + 9);
+  // Optional message data used for debugging particle's sensing and associations
+  msgJson["best_particle_associations"] = vec_to_string(best_particle.associations);
+  msgJson["best_particle_sense_x"] = vec_to_string(best_particle.sense_x);
+  msgJson["best_particle_sense_y"] = vec_to_string(best_particle.sense_y);
+  // set when the update ran out of time and skipped observations
+  msgJson["partial"] = result.partial;
+  auto msg = "42[\"best_particle\"," + msgJson.dump() + "]";
+  // std::cout << msg << std::endl;
+  uint64_t send_ns = profile ? now_ns() : 0;
+  ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+
+  if(profile) {
+    uint64_t done_ns = now_ns();
+    Profiler::span(Stage::SERIALIZE, serialize_ns, send_ns);
+    Profiler::span(Stage::SEND, send_ns, done_ns);
+    Profiler::span(Stage::FRAME, recv_ns, done_ns);
+  }
+}
+
+std::string SimIO::clientId(uWS::HttpRequest req) {
+  uWS::Header url = req.getUrl();
+  std::string query = url ? url.toString() : std::string();
+  size_t start = query.find('?');
+  while(start != std::string::npos) {
+    start++;
+    size_t end = query.find('&', start);
+    std::string parameter = query.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    if(parameter.compare(0, 8, "vehicle=") == 0 && parameter.size() > 8 &&
+       parameter.find_first_of("/.") == std::string::npos) {
+      return parameter.substr(8);
+    }
+    start = end;
+  }
+  return "default";
 }
 
 std::string SimIO::hasData(std::string s) {
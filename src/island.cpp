@@ -0,0 +1,474 @@
+#include "island.hpp"
+#include "session.hpp"
+#include "map_file.hpp"
+#include "helpers.hpp"
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+namespace {
+
+// message types between coordinator and workers
+enum class Message : uint8_t {
+  CONFIG = 1,    // coordinator: filter configuration, seed and update settings
+  STEP = 2,      // coordinator: frames and immigrants, worker: result and emigrants
+  ODOMETRY = 3   // coordinator: odometry sample, worker: pose estimate
+};
+
+void malformed() {
+  throw std::runtime_error("Malformed island message");
+}
+
+// writes a length prefixed message
+void send_message(int fd, const std::string& message) {
+  std::string buffer;
+  uint32_t size = static_cast<uint32_t>(message.size());
+  buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  buffer.append(message);
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  // a dead worker is an error, not a signal
+  flags = MSG_NOSIGNAL;
+#endif
+  for(size_t sent=0; sent<buffer.size(); ) {
+    ssize_t n = ::send(fd, buffer.data() + sent, buffer.size() - sent, flags);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      throw std::runtime_error(std::string("Island connection lost: ") + std::strerror(errno));
+    }
+    sent += n;
+  }
+}
+
+// reads exactly size bytes, false on a clean end of stream before the first byte
+bool receive_all(int fd, char* data, size_t size) {
+  for(size_t received=0; received<size; ) {
+    ssize_t n = ::read(fd, data + received, size - received);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n == 0 && received == 0) {
+      return false;
+    }
+    if(n <= 0) {
+      throw std::runtime_error("Island connection lost");
+    }
+    received += n;
+  }
+  return true;
+}
+
+// reads a length prefixed message, false if the peer closed the connection
+bool receive_message(int fd, std::string& message) {
+  uint32_t size = 0;
+  if(!receive_all(fd, reinterpret_cast<char*>(&size), sizeof(size))) {
+    return false;
+  }
+  message.resize(size);
+  if(size > 0 && !receive_all(fd, &message[0], size)) {
+    throw std::runtime_error("Island connection lost");
+  }
+  return true;
+}
+
+void write_config(std::ostream& out, const filter_config_t& c) {
+  write_pod(out, static_cast<int32_t>(c.num_particles));
+  write_pod(out, c.delta_t);
+  write_pod(out, c.sensor_range);
+  out.write(reinterpret_cast<const char*>(c.sigma_pos), sizeof(c.sigma_pos));
+  out.write(reinterpret_cast<const char*>(c.sigma_landmark), sizeof(c.sigma_landmark));
+}
+
+void read_config(std::istream& in, filter_config_t& c) {
+  int32_t num_particles = 0;
+  if(!read_pod(in, num_particles) || !read_pod(in, c.delta_t) || !read_pod(in, c.sensor_range) ||
+     !in.read(reinterpret_cast<char*>(c.sigma_pos), sizeof(c.sigma_pos)) ||
+     !in.read(reinterpret_cast<char*>(c.sigma_landmark), sizeof(c.sigma_landmark))) {
+    malformed();
+  }
+  c.num_particles = num_particles;
+}
+
+// frames keep their observations in full precision, unlike telemetry logs
+void write_frame(std::ostream& out, const telemetry_t& frame) {
+  write_pod(out, frame.sense_x);
+  write_pod(out, frame.sense_y);
+  write_pod(out, frame.sense_theta);
+  write_pod(out, frame.prev_velocity);
+  write_pod(out, frame.prev_yawrate);
+  write_pod(out, static_cast<uint32_t>(frame.observations.size()));
+  for(auto const& obs : frame.observations) {
+    write_pod(out, obs.x);
+    write_pod(out, obs.y);
+  }
+}
+
+void read_frame(std::istream& in, telemetry_t& frame) {
+  uint32_t num_obs = 0;
+  if(!read_pod(in, frame.sense_x) || !read_pod(in, frame.sense_y) || !read_pod(in, frame.sense_theta) ||
+     !read_pod(in, frame.prev_velocity) || !read_pod(in, frame.prev_yawrate) || !read_pod(in, num_obs)) {
+    malformed();
+  }
+  frame.observations.resize(num_obs);
+  for(auto& obs : frame.observations) {
+    obs.id = -1;
+    if(!read_pod(in, obs.x) || !read_pod(in, obs.y)) {
+      malformed();
+    }
+  }
+}
+
+void write_particle(std::ostream& out, const particle_t& p) {
+  write_pod(out, static_cast<int32_t>(p.id));
+  write_pod(out, p.x);
+  write_pod(out, p.y);
+  write_pod(out, p.theta);
+  write_pod(out, p.weight);
+  write_pod(out, static_cast<uint32_t>(p.associations.size()));
+  for(size_t k=0; k<p.associations.size(); k++) {
+    write_pod(out, static_cast<int32_t>(p.associations[k]));
+    write_pod(out, p.sense_x[k]);
+    write_pod(out, p.sense_y[k]);
+  }
+}
+
+void read_particle(std::istream& in, particle_t& p) {
+  int32_t id = 0;
+  uint32_t num_associations = 0;
+  if(!read_pod(in, id) || !read_pod(in, p.x) || !read_pod(in, p.y) || !read_pod(in, p.theta) ||
+     !read_pod(in, p.weight) || !read_pod(in, num_associations)) {
+    malformed();
+  }
+  p.id = id;
+  p.associations.resize(num_associations);
+  p.sense_x.resize(num_associations);
+  p.sense_y.resize(num_associations);
+  for(size_t k=0; k<num_associations; k++) {
+    int32_t association = 0;
+    if(!read_pod(in, association) || !read_pod(in, p.sense_x[k]) || !read_pod(in, p.sense_y[k])) {
+      malformed();
+    }
+    p.associations[k] = association;
+  }
+}
+
+void write_particles(std::ostream& out, const std::vector<particle_t>& particles) {
+  write_pod(out, static_cast<uint32_t>(particles.size()));
+  for(auto const& p : particles) {
+    write_particle(out, p);
+  }
+}
+
+void read_particles(std::istream& in, std::vector<particle_t>& particles) {
+  uint32_t count = 0;
+  if(!read_pod(in, count)) {
+    malformed();
+  }
+  particles.resize(count);
+  for(auto& p : particles) {
+    read_particle(in, p);
+  }
+}
+
+void read_estimate(std::istream& in, pose_estimate_t& estimate) {
+  if(!read_pod(in, estimate)) {
+    malformed();
+  }
+}
+
+}
+
+IslandCoordinator::IslandCoordinator(const filter_config_t& config, const island_config_t& islands,
+                                     uint64_t update_deadline_ns, int update_interval) :
+  config_(islands), frames_(0) {
+  if(islands.islands < 1) {
+    throw std::runtime_error("At least one island is needed");
+  }
+  // islands cut off at different observations, their weights would not be comparable
+  if(update_deadline_ns) {
+    throw std::runtime_error("Islands do not support an update deadline");
+  }
+  try {
+    start(config, update_deadline_ns, update_interval);
+  } catch(std::runtime_error&) {
+    stop();
+    throw;
+  }
+}
+
+IslandCoordinator::~IslandCoordinator() {
+  stop();
+}
+
+void IslandCoordinator::start(const filter_config_t& config, uint64_t update_deadline_ns, int update_interval) {
+  const island_config_t& islands = config_;
+  for(int i=0; i<islands.islands; i++) {
+    int fds[2];
+    int type = SOCK_STREAM;
+#ifdef SOCK_CLOEXEC
+    // atomically, processes forked meanwhile by other threads must not inherit either end
+    type |= SOCK_CLOEXEC;
+#endif
+    if(socketpair(AF_UNIX, type, 0, fds) != 0) {
+      throw std::runtime_error(std::string("Cannot create island socket: ") + std::strerror(errno));
+    }
+#ifndef SOCK_CLOEXEC
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    // the child may only make async-signal-safe calls until exec, the server has other threads
+    std::string fd = std::to_string(fds[1]);
+    const char* argv[] = {islands.worker.c_str(), fd.c_str(), islands.map_file.c_str(), nullptr};
+    pid_t pid = fork();
+    if(pid == 0) {
+      // only the worker end is inherited, so workers see the coordinator closing
+      fcntl(fds[1], F_SETFD, 0);
+      execv(islands.worker.c_str(), const_cast<char* const*>(argv));
+      _exit(127);
+    }
+    close(fds[1]);
+    if(pid < 0) {
+      close(fds[0]);
+      throw std::runtime_error(std::string("Cannot start island worker: ") + std::strerror(errno));
+    }
+
+    // particles are split evenly, the first islands take the remainder
+    size_t num_particles = config.num_particles / islands.islands + (i < config.num_particles % islands.islands);
+    workers_.push_back(worker_t{pid, fds[0], num_particles, std::vector<particle_t>()});
+
+    filter_config_t island_config = config;
+    island_config.num_particles = static_cast<int>(num_particles);
+    std::ostringstream out;
+    write_pod(out, static_cast<uint8_t>(Message::CONFIG));
+    write_config(out, island_config);
+    write_pod(out, static_cast<uint32_t>(i + 1));
+    write_pod(out, update_deadline_ns);
+    write_pod(out, static_cast<int32_t>(update_interval));
+    try {
+      send_message(fds[0], out.str());
+    } catch(std::runtime_error&) {
+      throw std::runtime_error("Cannot start island worker " + islands.worker);
+    }
+  }
+}
+
+void IslandCoordinator::stop() {
+  for(auto const& w : workers_) {
+    close(w.fd);
+  }
+  for(auto const& w : workers_) {
+    waitpid(w.pid, nullptr, 0);
+  }
+  workers_.clear();
+}
+
+frame_result_t IslandCoordinator::process(const telemetry_t* frames, size_t count, uint64_t recv_ns) {
+  if(recv_ns == 0) {
+    recv_ns = now_ns();
+  }
+  bool exchange = workers_.size() > 1 && config_.exchange_interval > 0 &&
+                  ++frames_ % config_.exchange_interval == 0;
+
+  // all islands work on the frame concurrently
+  for(auto& w : workers_) {
+    std::ostringstream out;
+    write_pod(out, static_cast<uint8_t>(Message::STEP));
+    write_pod(out, recv_ns);
+    write_pod(out, static_cast<uint32_t>(count));
+    for(size_t k=0; k<count; k++) {
+      write_frame(out, frames[k]);
+    }
+    uint32_t emigrants = exchange ? static_cast<uint32_t>(w.num_particles * config_.exchange_fraction) : 0;
+    write_pod(out, emigrants);
+    write_particles(out, w.arrivals);
+    w.arrivals.clear();
+    send_message(w.fd, out.str());
+  }
+
+  frame_result_t result{particle_t(), pose_estimate_t(), false, 0};
+  std::vector<pose_estimate_t> estimates(workers_.size());
+  size_t offset = 0;
+  double best_weight = -1.0;
+  for(size_t i=0; i<workers_.size(); i++) {
+    std::string message;
+    if(!receive_message(workers_[i].fd, message)) {
+      throw std::runtime_error("Island worker " + std::to_string(i) + " exited");
+    }
+    std::istringstream in(message);
+    particle_t best;
+    uint8_t partial = 0;
+    uint64_t observations_used = 0;
+    read_estimate(in, estimates[i]);
+    if(!read_pod(in, partial) || !read_pod(in, observations_used)) {
+      malformed();
+    }
+    read_particle(in, best);
+    // emigrants move on to the next island with its next frame
+    read_particles(in, workers_[(i + 1) % workers_.size()].arrivals);
+
+    if(estimates[i].best_weight > best_weight) {
+      best_weight = estimates[i].best_weight;
+      result.best = best;
+    }
+    estimates[i].best_index += offset;
+    offset += workers_[i].num_particles;
+    result.partial = result.partial || partial;
+    result.observations_used = i == 0 ? observations_used : std::min<size_t>(result.observations_used, observations_used);
+  }
+  result.estimate = merge(estimates);
+  return result;
+}
+
+pose_estimate_t IslandCoordinator::predictOnly(const odometry_t& odometry) {
+  std::ostringstream out;
+  write_pod(out, static_cast<uint8_t>(Message::ODOMETRY));
+  write_pod(out, odometry);
+  for(auto const& w : workers_) {
+    send_message(w.fd, out.str());
+  }
+  std::vector<pose_estimate_t> estimates(workers_.size());
+  size_t offset = 0;
+  for(size_t i=0; i<workers_.size(); i++) {
+    std::string message;
+    if(!receive_message(workers_[i].fd, message)) {
+      throw std::runtime_error("Island worker " + std::to_string(i) + " exited");
+    }
+    std::istringstream in(message);
+    read_estimate(in, estimates[i]);
+    estimates[i].best_index += offset;
+    offset += workers_[i].num_particles;
+  }
+  return merge(estimates);
+}
+
+pose_estimate_t IslandCoordinator::merge(const std::vector<pose_estimate_t>& estimates) const {
+  pose_estimate_t e{};
+  e.best_weight = -1.0;
+  double total = 0.0;
+  for(auto const& island : estimates) {
+    total += island.weight_sum;
+    if(island.best_weight > e.best_weight) {
+      e.best_weight = island.best_weight;
+      e.best_index = island.best_index;
+    }
+  }
+  e.weight_sum = total;
+  // islands that lost all weight still count equally when all did
+  auto share = [&](const pose_estimate_t& island) {
+    return total > 0 ? island.weight_sum / total : 1.0 / estimates.size();
+  };
+
+  // mean of the island means, headings relative to the first island
+  const pose_t& ref = estimates[0].mean;
+  std::vector<pose_t> deviation(estimates.size());
+  pose_t mean{0.0, 0.0, 0.0};
+  for(size_t i=0; i<estimates.size(); i++) {
+    const pose_t& m = estimates[i].mean;
+    deviation[i] = pose_t{m.x, m.y, ref.theta + std::remainder(m.theta - ref.theta, 2*M_PI)};
+    double w = share(estimates[i]);
+    mean.x += w * deviation[i].x;
+    mean.y += w * deviation[i].y;
+    mean.theta += w * deviation[i].theta;
+  }
+
+  // law of total covariance: within island covariance plus the spread of the island means
+  for(size_t i=0; i<estimates.size(); i++) {
+    double w = share(estimates[i]);
+    double d[3] = {deviation[i].x - mean.x, deviation[i].y - mean.y, deviation[i].theta - mean.theta};
+    for(int r=0; r<3; r++) {
+      for(int c=0; c<3; c++) {
+        e.covariance[3*r + c] += w * (estimates[i].covariance[3*r + c] + d[r] * d[c]);
+      }
+    }
+  }
+  // same [-pi, pi] range as ParticleFilter::estimate
+  mean.theta = std::remainder(mean.theta, 2*M_PI);
+  e.mean = mean;
+  return e;
+}
+
+int run_island_worker(int fd, const std::string& map_file) {
+  try {
+    std::string message;
+    if(!receive_message(fd, message)) {
+      return 0;
+    }
+    std::istringstream config_in(message);
+    uint8_t type = 0;
+    filter_config_t config;
+    uint32_t seed = 0;
+    uint64_t update_deadline_ns = 0;
+    int32_t update_interval = 1;
+    if(!read_pod(config_in, type) || type != static_cast<uint8_t>(Message::CONFIG)) {
+      malformed();
+    }
+    read_config(config_in, config);
+    if(!read_pod(config_in, seed) || !read_pod(config_in, update_deadline_ns) || !read_pod(config_in, update_interval)) {
+      malformed();
+    }
+
+    MapSource map(map_file);
+    Session session(0, config, map);
+    session.setSeed(seed);
+    session.setUpdateDeadline(update_deadline_ns);
+    session.setUpdateInterval(update_interval);
+
+    while(receive_message(fd, message)) {
+      std::istringstream in(message);
+      std::ostringstream out;
+      if(!read_pod(in, type)) {
+        malformed();
+      }
+      if(type == static_cast<uint8_t>(Message::STEP)) {
+        uint64_t recv_ns = 0;
+        uint32_t count = 0;
+        uint32_t emigrants = 0;
+        if(!read_pod(in, recv_ns) || !read_pod(in, count) || count == 0) {
+          malformed();
+        }
+        std::vector<telemetry_t> frames(count);
+        for(auto& frame : frames) {
+          read_frame(in, frame);
+        }
+        std::vector<particle_t> immigrants;
+        if(!read_pod(in, emigrants)) {
+          malformed();
+        }
+        read_particles(in, immigrants);
+
+        session.immigrate(immigrants);
+        frame_result_t result = session.processBacklog(frames, recv_ns);
+        write_pod(out, result.estimate);
+        write_pod(out, static_cast<uint8_t>(result.partial));
+        write_pod(out, static_cast<uint64_t>(result.observations_used));
+        write_particle(out, result.best);
+        write_particles(out, session.emigrants(emigrants));
+      } else if(type == static_cast<uint8_t>(Message::ODOMETRY)) {
+        odometry_t odometry;
+        if(!read_pod(in, odometry)) {
+          malformed();
+        }
+        write_pod(out, session.predictOnly(odometry));
+      } else {
+        malformed();
+      }
+      send_message(fd, out.str());
+    }
+  } catch(std::runtime_error& e) {
+    std::cerr << "Island worker: " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include "landmark_map.hpp"
+
+#include <limits>
+#include <stdexcept>
+
+constexpr double LandmarkMap::DEFAULT_CELL_SIZE;
+
+LandmarkMap::LandmarkMap(const std::vector<landmark_t>& landmarks, double cell_size) {
+  if(cell_size <= 0) {
+    throw std::invalid_argument("Grid cell size must be positive");
+  }
+
+  map_view_t& v = view_;
+  v.count = static_cast<uint32_t>(landmarks.size());
+  v.cell_size = cell_size;
+  v.min_x = v.min_y = 0;
+  v.max_x = v.max_y = 0;
+  if(!landmarks.empty()) {
+    v.min_x = v.min_y = std::numeric_limits<double>::max();
+    v.max_x = v.max_y = std::numeric_limits<double>::lowest();
+  }
+  for(auto const& l : landmarks) {
+    v.min_x = std::min(v.min_x, l.x);
+    v.min_y = std::min(v.min_y, l.y);
+    v.max_x = std::max(v.max_x, l.x);
+    v.max_y = std::max(v.max_y, l.y);
+  }
+  v.cols = static_cast<uint32_t>((v.max_x - v.min_x) / cell_size) + 1;
+  v.rows = static_cast<uint32_t>((v.max_y - v.min_y) / cell_size) + 1;
+
+  // counting sort of the landmarks by grid cell
+  std::vector<uint32_t> cells(landmarks.size());
+  cell_start_.assign(v.cols * v.rows + 1, 0);
+  for(size_t i=0; i<landmarks.size(); i++) {
+    cells[i] = v.cell_row(landmarks[i].y) * v.cols + v.cell_col(landmarks[i].x);
+    cell_start_[cells[i] + 1]++;
+  }
+  for(size_t c=1; c<cell_start_.size(); c++) {
+    cell_start_[c] += cell_start_[c-1];
+  }
+  std::vector<uint32_t> next(cell_start_.begin(), cell_start_.end() - 1);
+  id_.resize(landmarks.size());
+  x_.resize(landmarks.size());
+  y_.resize(landmarks.size());
+  for(size_t i=0; i<landmarks.size(); i++) {
+    uint32_t j = next[cells[i]]++;
+    id_[j] = landmarks[i].id;
+    x_[j] = landmarks[i].x;
+    y_[j] = landmarks[i].y;
+  }
+
+  v.id = id_.data();
+  v.x = x_.data();
+  v.y = y_.data();
+  v.cell_start = cell_start_.data();
+}
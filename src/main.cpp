@@ -1,55 +1,353 @@
 #include <iostream>
+#include <thread>
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
 
 #include "types.hpp"
 #include "io.hpp"
-#include "particle_filter.hpp"
+#include "session.hpp"
+#include "telemetry_log.hpp"
+#include "map_file.hpp"
+#include "profiler.hpp"
+#include "auto_tuner.hpp"
+#include "scenario.hpp"
 
+#ifdef EMBEDDED_MAP
+// map compiled into the binary (cmake -DEMBED_MAP=...), used unless --map is given
+#include "embedded_map.hpp"
+const std::string MAP_FILE = "";
+#else
 const std::string MAP_FILE = "../data/map_data.txt";
+#endif
 const int PORT = 4567;
 
-int main() {
+/*
+ * Signals that shut the server down
+ */
+sigset_t shutdown_signals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
+}
+
+/*
+ * Runs the server on a background thread and blocks until SIGINT or SIGTERM
+ * arrives or the server stops, so shutdown work runs on the main thread.
+ * main blocks the signals before it starts any thread, so only sigwait sees them.
+ */
+void run_until_shutdown(SimIO& simulator) {
+  sigset_t signals = shutdown_signals();
+  std::thread server([&simulator] {
+    simulator.run();
+    kill(getpid(), SIGTERM);
+  });
+  server.detach();
+
+  int signal = 0;
+  sigwait(&signals, &signal);
+  std::cout << "Shutting down" << std::endl;
+}
+
+/*
+ * Calibrates the particle and update thread count against a latency budget
+ * on the frames of a recorded log or, without one, a synthetic scenario
+ * @param tuner latency budget settings
+ * @param config filter configuration
+ * @param map map of the log
+ * @param log_file recorded telemetry log, empty for a synthetic scenario
+ * @param setup update settings of the sessions
+ */
+tuning_t calibrate_at_startup(const tuner_config_t& tuner, const filter_config_t& config,
+                              const MapSource& map, const std::string& log_file, const SessionSetup& setup) {
+  // frames timed per configuration
+  const int CALIBRATION_FRAMES = 100;
+
+  std::vector<telemetry_t> frames;
+  if(!log_file.empty() && !map.tiled()) {
+    TelemetryReader reader(log_file);
+    telemetry_record_t record;
+    int session_id = -1;
+    while(frames.size() < CALIBRATION_FRAMES && reader.next(record)) {
+      if(record.type != RecordType::FRAME || (session_id >= 0 && record.session_id != session_id)) {
+        continue;
+      }
+      session_id = record.session_id;
+      frames.push_back(record.frame);
+    }
+    return calibrate(tuner, config, frames, map.view(), &std::cout, setup);
+  }
+
+  if(!log_file.empty()) {
+    std::cout << "Tiled maps are calibrated on a synthetic scenario" << std::endl;
+  }
+  scenario_config_t sc = default_scenario_config(config);
+  sc.num_frames = CALIBRATION_FRAMES;
+  scenario_t scenario = generate_scenario(sc, generate_map(sc));
+  LandmarkMap landmarks(scenario.map);
+  return calibrate(tuner, config, scenario.frames, landmarks.view(), &std::cout, setup);
+}
+
+int main(int argc, char* argv[]) {
+  // every thread started below (pools, tracer, reporter, prefetcher) inherits the blocked signals
+  sigset_t signals = shutdown_signals();
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  // number of event-loop threads serving simulator connections
+  int num_threads = 1;
+  // optional telemetry log
+  std::string record_file;
+  // text or binary (*.bin) map file
+  std::string map_file = MAP_FILE;
+  // memory cap for tiled maps
+  size_t tile_cache = MapSource::DEFAULT_TILE_CACHE;
+  // stage latency statistics, reporting period [s] (0: only at shutdown)
+  bool stats = false;
+  double stats_period = 0;
+  // Chrome trace file
+  std::string trace_file;
+  // slow-frame flight recorder, off unless a threshold is given
+  flight_config_t flight{100, 0, "."};
+  // p99 frame latency budget [ms] (0: fixed particle count) and calibration log
+  double budget_ms = 0;
+  std::string calibrate_log;
+  // weight update threads per session loop (0: calibrated or single threaded)
+  int pool_threads = 0;
+  // weight update deadline after frame receipt [ms] (0: use all observations)
+  double deadline_ms = 0;
+  // coalesce queued frames, weight update on every Kth iteration
+  bool coalesce = false;
+  int update_every = 1;
+  // pose sent to the simulator
+  PoseReport report = PoseReport::BEST;
+  // resampling algorithm
+  Resampler resampler = Resampler::WHEEL;
+  // island worker processes per session (0: single process)
+  island_config_t island = default_island_config(0, sibling_executable(argv[0], "island_worker"), MAP_FILE);
+  // filter checkpoints for warm restarts, off unless a path is given
+  checkpoint_config_t checkpoint{"", 100};
+  // particles of global localization (0: initialize from GPS) and its KLD error bound
+  int global_particles = 0;
+  double kld_epsilon = 0.05;
+  // observations of the coarse update stage (0: single stage) and share of the particles refined
+  size_t coarse_observations = 0;
+  double fine_fraction = 0.1;
+  for(int i=1; i<argc; i++) {
+    std::string value;
+    if(parse_flag(argv[i], "threads", value)) {
+      num_threads = std::stoi(value);
+      if(num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+    } else if(parse_flag(argv[i], "record", value)) {
+      record_file = value;
+    } else if(parse_flag(argv[i], "map", value)) {
+      map_file = value;
+    } else if(parse_flag(argv[i], "tile-cache-mb", value)) {
+      tile_cache = std::stoul(value) << 20;
+    } else if(parse_flag(argv[i], "stats", value)) {
+      stats = true;
+      stats_period = std::stod(value);
+    } else if(parse_flag(argv[i], "trace", value)) {
+      trace_file = value;
+    } else if(parse_flag(argv[i], "flight-threshold-ms", value)) {
+      flight.threshold_ns = static_cast<uint64_t>(std::stod(value) * 1e6);
+    } else if(parse_flag(argv[i], "flight-frames", value)) {
+      flight.frames = std::stoul(value);
+    } else if(parse_flag(argv[i], "flight-dir", value)) {
+      flight.directory = value;
+    } else if(parse_flag(argv[i], "latency-budget-ms", value)) {
+      budget_ms = std::stod(value);
+    } else if(parse_flag(argv[i], "calibrate-log", value)) {
+      calibrate_log = value;
+    } else if(parse_flag(argv[i], "pool-threads", value)) {
+      pool_threads = std::stoi(value);
+    } else if(parse_flag(argv[i], "update-deadline-ms", value)) {
+      deadline_ms = std::stod(value);
+    } else if(std::string(argv[i]) == "--coalesce") {
+      coalesce = true;
+    } else if(parse_flag(argv[i], "update-every", value)) {
+      update_every = std::max(1, std::stoi(value));
+    } else if(parse_flag(argv[i], "report", value) && (value == "best" || value == "mean")) {
+      report = value == "mean" ? PoseReport::MEAN : PoseReport::BEST;
+    } else if(parse_flag(argv[i], "resampler", value) && parse_resampler(value, resampler)) {
+    } else if(parse_flag(argv[i], "islands", value)) {
+      island.islands = std::stoi(value);
+    } else if(parse_flag(argv[i], "island-exchange", value)) {
+      island.exchange_fraction = std::stod(value);
+    } else if(parse_flag(argv[i], "island-exchange-every", value)) {
+      island.exchange_interval = std::stoi(value);
+    } else if(parse_flag(argv[i], "island-worker", value)) {
+      island.worker = value;
+    } else if(parse_flag(argv[i], "checkpoint", value)) {
+      checkpoint.path = value;
+    } else if(parse_flag(argv[i], "checkpoint-every", value)) {
+      checkpoint.interval = std::stoul(value);
+    } else if(parse_flag(argv[i], "global", value)) {
+      global_particles = std::stoi(value);
+    } else if(parse_flag(argv[i], "kld-epsilon", value)) {
+      kld_epsilon = std::stod(value);
+    } else if(parse_flag(argv[i], "coarse-observations", value)) {
+      coarse_observations = std::stoul(value);
+    } else if(parse_flag(argv[i], "fine-fraction", value)) {
+      fine_fraction = std::stod(value);
+    } else {
+      std::cerr << "Unknown argument " << argv[i] << std::endl;
+      std::cerr << "Usage: " << argv[0] << " [--threads=N] [--record=telemetry.log] [--map=map.bin|map.tiles] [--tile-cache-mb=64]"
+                << " [--stats=period_s] [--trace=trace.json]"
+                << " [--flight-threshold-ms=T] [--flight-frames=100] [--flight-dir=.]"
+                << " [--latency-budget-ms=B] [--calibrate-log=telemetry.log] [--pool-threads=N]"
+                << " [--update-deadline-ms=D] [--coalesce] [--update-every=K]"
+                << " [--report=best|mean] [--resampler=wheel|systematic|metropolis]"
+                << " [--islands=N] [--island-exchange=0.05] [--island-exchange-every=10] [--island-worker=path]"
+                << " [--checkpoint=path] [--checkpoint-every=100]"
+                << " [--global=N] [--kld-epsilon=0.05] [--coarse-observations=M] [--fine-fraction=0.1]" << std::endl;
+      return -1;
+    }
+  }
+
   // read map data
-  std::vector<landmark_t> map;
+  std::unique_ptr<MapSource> map;
   try {
-    map = read_map(MAP_FILE);
+#ifdef EMBEDDED_MAP
+    if(map_file.empty()) {
+      map.reset(new MapSource(embedded_map_view()));
+    }
+#endif
+    if(!map) {
+      map.reset(new MapSource(map_file, tile_cache));
+    }
   } catch(std::runtime_error& e) {
     std::cerr << e.what() << std::endl;
     return -1;
   }
 
-  // Time elapsed between measurements [sec]
-  double delta_t = 0.1;
-  // Sensor range [m]
-  double sensor_range = 50;
-  // GPS measurement uncertainty [x [m], y [m], theta [rad]]
-  double sigma_pos [3] = {0.3, 0.3, 0.01};
-  // Landmark measurement uncertainty [x [m], y [m]]
-  double sigma_landmark [2] = {0.3, 0.3};
-  // number of particles
-  int num_particles = 100;
+  filter_config_t config = default_filter_config();
+  island.map_file = map_file;
+  if(island.islands > 0 && map_file.empty()) {
+    std::cerr << "Island workers load the map themselves, give it with --map" << std::endl;
+    return -1;
+  }
+  if(island.islands > 0 && deadline_ms > 0) {
+    std::cerr << "--islands cannot be combined with --update-deadline-ms" << std::endl;
+    return -1;
+  }
+  // checked here, the sessions only start localizing on the first frame
+  if(global_particles > 0 && island.islands > 0) {
+    std::cerr << "--global cannot be combined with --islands" << std::endl;
+    return -1;
+  }
+  if(global_particles > 0 && (map->tiled() || map->view().count == 0)) {
+    std::cerr << "--global needs a map in memory, not a tiled or empty one" << std::endl;
+    return -1;
+  }
+  if(flight.threshold_ns && access(flight.directory.c_str(), W_OK) != 0) {
+    std::cerr << "--flight-dir " << flight.directory << " is not a writable directory" << std::endl;
+    return -1;
+  }
+
+  // update settings of every session, also used for the calibration
+  SessionSetup setup = [&](Session& session) {
+    session.setUpdateDeadline(static_cast<uint64_t>(deadline_ms * 1e6));
+    session.setUpdateInterval(update_every);
+    session.setResampler(resampler);
+    session.setTwoStageUpdate(coarse_observations, fine_fraction);
+  };
 
-  // create particle filter
-  ParticleFilter particle_filter(num_particles);
+  // pick the particle and thread count for this machine
+  tuner_config_t tuner = default_tuner_config(static_cast<uint64_t>(budget_ms * 1e6));
+  if(budget_ms > 0) {
+    try {
+      if(pool_threads > 0) {
+        tuner.max_threads = pool_threads;
+      }
+      tuning_t tuning = calibrate_at_startup(tuner, config, *map, calibrate_log, setup);
+      if(tuning.p99_ns == 0) {
+        std::cerr << "Latency budget of " << budget_ms << " ms cannot be met with "
+                  << tuner.min_particles << " particles" << std::endl;
+      }
+      config.num_particles = tuning.num_particles;
+      pool_threads = tuning.num_threads;
+      std::cout << "Calibrated to " << tuning.num_particles << " particles on " << tuning.num_threads
+                << " threads, p99 " << tuning.p99_ns * 1e-3 << " us" << std::endl;
+    } catch(std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+  }
+  std::unique_ptr<ThreadPool> pool;
+  if(pool_threads > 1) {
+    pool.reset(new ThreadPool(pool_threads));
+  }
 
   std::cout << "Connecting to simulator" << std::endl;
-  SimIO simulator(PORT, [&](double sense_x, double sense_y, double sense_theta, double prev_velocity, double prev_yawrate, std::vector<landmark_t> observations) {
-    if(!particle_filter.initialized()) {
-      // if not initialized, initialize with GPS data
-      particle_filter.init(sense_x, sense_y, sense_theta, sigma_pos);
-    } else {
-      // run the prediction step
-      particle_filter.prediction(delta_t, prev_velocity, prev_yawrate, sigma_pos);
+  // each connection gets its own session, the map is shared read-only
+  SimIO simulator(PORT, num_threads, [&](int id, const std::string& client) {
+    std::unique_ptr<Session> session(new Session(id, config, *map));
+    session->setThreadPool(pool.get());
+    setup(*session);
+    if(island.islands > 0) {
+      session->enableIslands(island);
+    }
+    if(budget_ms > 0) {
+      session->enableAutoTune(tuner);
+    }
+    if(flight.threshold_ns) {
+      session->enableFlightRecorder(flight);
+    }
+    if(global_particles > 0) {
+      global_config_t global{global_particles, default_kld_config(config.num_particles, global_particles)};
+      global.kld.epsilon = kld_epsilon;
+      session->enableGlobalLocalization(global);
     }
+    if(!checkpoint.path.empty() && session->enableCheckpoints(checkpoint, client)) {
+      std::cout << "Session " << id << " restored from checkpoint" << std::endl;
+    }
+    return session;
+  });
 
-    // Update the weights and resample
-    particle_filter.updateWeights(sensor_range, sigma_landmark, observations, map);
-    particle_filter.resample();
+  simulator.setCoalescing(coalesce);
+  simulator.setReport(report);
 
-    particle_t best_particle = particle_filter.get_best_particle();
-    return best_particle;
-  });
+  std::unique_ptr<TelemetryWriter> recorder;
+  if(!record_file.empty()) {
+    try {
+      recorder.reset(new TelemetryWriter(record_file));
+    } catch(std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+    simulator.setRecorder(recorder.get());
+    std::cout << "Recording telemetry to " << record_file << std::endl;
+  }
+
+  if(!trace_file.empty()) {
+    try {
+      Tracer::start(trace_file);
+    } catch(std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+  }
+  if(stats) {
+    Profiler::enable(true);
+    if(stats_period > 0) {
+      Profiler::report_periodically(stats_period);
+    }
+  }
 
-  simulator.run();
+  run_until_shutdown(simulator);
 
-  return 0;
+  if(!checkpoint.path.empty()) {
+    simulator.checkpointSessions();
+  }
+  if(stats) {
+    Profiler::report(std::cout);
+  }
+  Tracer::stop();
+  // hub threads are still running, skip destructors
+  std::cout.flush();
+  std::_Exit(0);
 }
@@ -0,0 +1,258 @@
+#include "map_file.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "helpers.hpp"
+
+namespace {
+
+bool has_extension(const std::string& filename, const std::string& ext) {
+  return filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+bool is_shared(const std::string& filename) {
+  return filename.compare(0, sizeof(SHARED_MAP_PREFIX) - 1, SHARED_MAP_PREFIX) == 0;
+}
+
+const char MAGIC[8] = {'P', 'F', 'M', 'A', 'P', 0, 0, 0};
+const uint64_t SECTION_ALIGNMENT = 64;
+
+/*
+ * Writes a constexpr array definition, 64 byte aligned like the binary map sections
+ */
+template <class T>
+void write_array(std::ostream& out, const char* type, const char* name, const T* values, size_t count) {
+  out << "alignas(64) constexpr " << type << " " << name << "[" << count << "] = {";
+  for(size_t i=0; i<count; i++) {
+    out << (i % 8 ? " " : "\n  ") << values[i] << (i + 1 < count ? "," : "");
+  }
+  out << "\n};\n\n";
+}
+
+uint64_t align(uint64_t offset) {
+  return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+/*
+ * Checks that a section of count values of T starting at offset lies within an image of size bytes
+ * and is aligned for T, without overflowing on corrupt offsets or counts
+ */
+template <class T>
+bool section_fits(uint64_t offset, uint64_t count, uint64_t size) {
+  return offset % alignof(T) == 0 && offset <= size && count <= (size - offset) / sizeof(T);
+}
+
+// computes the section layout of a map image
+map_header_t make_header(const map_view_t& view) {
+  map_header_t h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = MAP_FORMAT_VERSION;
+  h.count = view.count;
+  h.min_x = view.min_x;
+  h.min_y = view.min_y;
+  h.max_x = view.max_x;
+  h.max_y = view.max_y;
+  h.cell_size = view.cell_size;
+  h.cols = view.cols;
+  h.rows = view.rows;
+  h.id_offset = align(sizeof(map_header_t));
+  h.x_offset = align(h.id_offset + sizeof(int32_t) * view.count);
+  h.y_offset = align(h.x_offset + sizeof(double) * view.count);
+  h.cell_start_offset = align(h.y_offset + sizeof(double) * view.count);
+  h.size = h.cell_start_offset + sizeof(uint32_t) * (uint64_t(view.cols) * view.rows + 1);
+  return h;
+}
+
+}
+
+size_t map_image_size(const map_view_t& view) {
+  return make_header(view).size;
+}
+
+void write_map_image(const map_view_t& view, void* buffer) {
+  map_header_t h = make_header(view);
+  char* out = static_cast<char*>(buffer);
+  std::memset(out, 0, h.size);
+  std::memcpy(out, &h, sizeof(h));
+  std::memcpy(out + h.id_offset, view.id, sizeof(int32_t) * view.count);
+  std::memcpy(out + h.x_offset, view.x, sizeof(double) * view.count);
+  std::memcpy(out + h.y_offset, view.y, sizeof(double) * view.count);
+  std::memcpy(out + h.cell_start_offset, view.cell_start, sizeof(uint32_t) * (uint64_t(view.cols) * view.rows + 1));
+}
+
+map_view_t parse_map_image(const void* data, size_t size) {
+  const char* base = static_cast<const char*>(data);
+  if(size < sizeof(map_header_t)) {
+    throw std::runtime_error("Map image too small");
+  }
+  const map_header_t* h = reinterpret_cast<const map_header_t*>(base);
+  if(std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0) {
+    throw std::runtime_error("Not a binary map");
+  }
+  if(h->version != MAP_FORMAT_VERSION) {
+    throw std::runtime_error("Unsupported binary map version " + std::to_string(h->version));
+  }
+  if(h->size > size || h->cols == 0 || h->rows == 0 ||
+     !section_fits<uint32_t>(h->cell_start_offset, uint64_t(h->cols) * h->rows + 1, h->size) ||
+     !section_fits<double>(h->y_offset, h->count, h->size) ||
+     !section_fits<double>(h->x_offset, h->count, h->size) ||
+     !section_fits<int32_t>(h->id_offset, h->count, h->size)) {
+    throw std::runtime_error("Corrupt binary map");
+  }
+  // the grid lookups index the landmark arrays through cell_start without further checks
+  if(!(h->cell_size > 0) || !std::isfinite(h->cell_size) ||
+     !std::isfinite(h->min_x) || !std::isfinite(h->min_y) || !std::isfinite(h->max_x) || !std::isfinite(h->max_y)) {
+    throw std::runtime_error("Corrupt binary map");
+  }
+  const uint32_t* cell_start = reinterpret_cast<const uint32_t*>(base + h->cell_start_offset);
+  uint64_t num_cells = uint64_t(h->cols) * h->rows;
+  for(uint64_t c=0; c<num_cells; c++) {
+    if(cell_start[c] > cell_start[c + 1]) {
+      throw std::runtime_error("Corrupt binary map");
+    }
+  }
+  if(cell_start[num_cells] != h->count) {
+    throw std::runtime_error("Corrupt binary map");
+  }
+
+  map_view_t v;
+  v.count = h->count;
+  v.id = reinterpret_cast<const int32_t*>(base + h->id_offset);
+  v.x = reinterpret_cast<const double*>(base + h->x_offset);
+  v.y = reinterpret_cast<const double*>(base + h->y_offset);
+  v.min_x = h->min_x;
+  v.min_y = h->min_y;
+  v.max_x = h->max_x;
+  v.max_y = h->max_y;
+  v.cell_size = h->cell_size;
+  v.cols = h->cols;
+  v.rows = h->rows;
+  v.cell_start = cell_start;
+  return v;
+}
+
+void write_map_file(const std::string& filename, const map_view_t& view) {
+  // uint64_t storage keeps the buffer aligned for the header
+  std::vector<uint64_t> buffer((map_image_size(view) + 7) / 8);
+  write_map_image(view, buffer.data());
+  std::ofstream out(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+  out.write(reinterpret_cast<const char*>(buffer.data()), map_image_size(view));
+  if(!out) {
+    throw std::runtime_error("Cannot write map file " + filename);
+  }
+}
+
+void write_map_header(const std::string& filename, const map_view_t& view, const std::string& source) {
+  if(view.count == 0) {
+    throw std::runtime_error("Cannot embed the empty map " + source);
+  }
+  std::ofstream out(filename.c_str(), std::ofstream::trunc);
+  // 17 significant digits read back to the same double
+  out << std::setprecision(17);
+  out << "// Generated by map_compiler from " << source << ", do not edit\n"
+      << "#ifndef EMBEDDED_MAP_H\n#define EMBEDDED_MAP_H\n\n"
+      << "#include \"landmark_map.hpp\"\n\n"
+      << "constexpr uint32_t EMBEDDED_MAP_COUNT = " << view.count << ";\n\n";
+  write_array(out, "int32_t", "EMBEDDED_MAP_ID", view.id, view.count);
+  write_array(out, "double", "EMBEDDED_MAP_X", view.x, view.count);
+  write_array(out, "double", "EMBEDDED_MAP_Y", view.y, view.count);
+  write_array(out, "uint32_t", "EMBEDDED_MAP_CELL_START", view.cell_start, view.cols * view.rows + 1);
+  out << "/*\n * returns a view of the embedded map\n */\n"
+      << "inline map_view_t embedded_map_view() {\n"
+      << "  return map_view_t{EMBEDDED_MAP_COUNT, EMBEDDED_MAP_ID, EMBEDDED_MAP_X, EMBEDDED_MAP_Y,\n"
+      << "                    " << view.min_x << ", " << view.min_y << ", " << view.max_x << ", " << view.max_y << ",\n"
+      << "                    " << view.cell_size << ", " << view.cols << ", " << view.rows << ", EMBEDDED_MAP_CELL_START};\n"
+      << "}\n\n#endif\n";
+  if(!out) {
+    throw std::runtime_error("Cannot write map header " + filename);
+  }
+}
+
+void publish_shared_map(const std::string& name, const map_view_t& view) {
+  // the complete image first, so the segment only gets valid once it is complete
+  size_t size = map_image_size(view);
+  std::vector<uint64_t> image((size + 7) / 8);
+  write_map_image(view, image.data());
+
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd < 0) {
+    throw std::runtime_error("Cannot create shared map " + name + ": " + std::strerror(errno));
+  }
+  void* data = MAP_FAILED;
+  if(ftruncate(fd, size) == 0) {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(data == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Cannot map shared map " + name + ": " + std::strerror(errno));
+  }
+  char* segment = static_cast<char*>(data);
+  const char* source = reinterpret_cast<const char*>(image.data());
+  std::memcpy(segment + sizeof(MAGIC), source + sizeof(MAGIC), size - sizeof(MAGIC));
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(segment, source, sizeof(MAGIC));
+  munmap(data, size);
+}
+
+void unlink_shared_map(const std::string& name) {
+  shm_unlink(name.c_str());
+}
+
+MappedMap::MappedMap(const std::string& filename) : data_(MAP_FAILED), size_(0) {
+  bool shared = is_shared(filename);
+  int fd = shared ? shm_open(filename.c_str() + sizeof(SHARED_MAP_PREFIX) - 1, O_RDONLY, 0)
+                  : open(filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    throw std::runtime_error(shared ? "Shared map " + filename + " not published." : "Map file not found.");
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0) {
+    size_ = st.st_size;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(data_ == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + filename);
+  }
+  try {
+    view_ = parse_map_image(data_, size_);
+  } catch(...) {
+    munmap(data_, size_);
+    throw;
+  }
+}
+
+MappedMap::~MappedMap() {
+  munmap(data_, size_);
+}
+
+MapSource::MapSource(const std::string& filename, size_t tile_cache) : embedded_() {
+  if(has_extension(filename, ".bin") || is_shared(filename)) {
+    mapped_.reset(new MappedMap(filename));
+  } else if(has_extension(filename, ".tiles")) {
+    tiled_.reset(new TiledMap(filename, tile_cache));
+    memory_.reset(new LandmarkMap(std::vector<landmark_t>()));
+  } else {
+    memory_.reset(new LandmarkMap(read_map(filename)));
+  }
+}
+
+MapSource::MapSource(const map_view_t& view) : embedded_(view) {}
+
+const map_view_t& MapSource::view() const {
+  return mapped_ ? mapped_->view() : memory_ ? memory_->view() : embedded_;
+}
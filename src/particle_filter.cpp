@@ -1,5 +1,10 @@
 #include "particle_filter.hpp"
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <unordered_map>
 #include <helpers.hpp>
 
 void ParticleFilter::init(double x, double y, double theta, double std[]) {
@@ -8,92 +13,727 @@ void ParticleFilter::init(double x, double y, double theta, double std[]) {
   std::normal_distribution<double> dist_y(y, std[1]);
   std::normal_distribution<double> dist_t(theta, std[2]);
 
-  // create N particles using gaussian distribution for initialization
+  // create N particles using gaussian distribution for initialization, replacing any earlier set
+  particles_.clear();
+  particles_.reserve(num_particles_);
   for(int i=0; i<num_particles_; i++) {
-    particle_t p;
+    state_t p;
     p.id = i;
     p.x = dist_x(gen_);
     p.y = dist_y(gen_);
-    p.theta = dist_t(gen_);
+    p.setHeading(dist_t(gen_));
     p.weight = 1;
+    p.row = NO_ROW;
     particles_.push_back(p);
   }
   is_initialized_ = true;
 }
 
+void ParticleFilter::initGlobal(const bbox_t& region, int num_particles) {
+  std::uniform_real_distribution<double> dist_x(region.min_x, region.max_x);
+  std::uniform_real_distribution<double> dist_y(region.min_y, region.max_y);
+  std::uniform_real_distribution<double> dist_t(0.0, 2*M_PI);
+
+  particles_.clear();
+  particles_.reserve(num_particles);
+  for(int i=0; i<num_particles; i++) {
+    state_t p;
+    p.id = i;
+    p.x = dist_x(gen_);
+    p.y = dist_y(gen_);
+    p.setHeading(dist_t(gen_));
+    p.weight = 1;
+    p.row = NO_ROW;
+    particles_.push_back(p);
+  }
+  num_particles_ = num_particles;
+  is_initialized_ = true;
+}
+
+namespace {
+
+// particles per independently seeded noise block
+const size_t NOISE_BLOCK = 4096;
+
+// particle count from which the noise is drawn in blocks
+const size_t BLOCK_NOISE_MIN = 65536;
+
+// histogram bins KLD-sampling counts in at most, coarser bins are used beyond
+const size_t MAX_KLD_BINS = size_t(1) << 26;
+
+}
+
+namespace {
+
+// noise angles up to this size [rad] are rotated by with their Taylor series
+const double SMALL_ANGLE = 0.1;
+
+/*
+ * Rotates the heading unit vector (c, s) by a shared angle given by its cos and
+ * sin plus a small per particle angle n, whose cos and sin come from their Taylor
+ * series (error below 3e-13 for |n| <= SMALL_ANGLE). The result is renormalized,
+ * so rounding errors do not accumulate over the frames.
+ */
+inline void rotate(double& c, double& s, double cos_d, double sin_d, double n) {
+  double cos_n, sin_n;
+  if(std::abs(n) <= SMALL_ANGLE) {
+    double n2 = n * n;
+    cos_n = 1 - n2 / 2 * (1 - n2 / 12 * (1 - n2 / 30));
+    sin_n = n * (1 - n2 / 6 * (1 - n2 / 20 * (1 - n2 / 42)));
+  } else {
+    cos_n = std::cos(n);
+    sin_n = std::sin(n);
+  }
+  double cos_r = cos_d * cos_n - sin_d * sin_n;
+  double sin_r = sin_d * cos_n + cos_d * sin_n;
+  double c_r = c * cos_r - s * sin_r;
+  double s_r = s * cos_r + c * sin_r;
+  double norm = 1.0 / std::sqrt(c_r * c_r + s_r * s_r);
+  c = c_r * norm;
+  s = s_r * norm;
+}
+
+}
+
+void ParticleFilter::drawNoise(const double std[], double scale) {
+  size_t num_particles = particles_.size();
+  noise_.resize(3 * num_particles);
+  if(num_particles < BLOCK_NOISE_MIN) {
+    std::normal_distribution<double> noise_x(0.0, std[0] * scale);
+    std::normal_distribution<double> noise_y(0.0, std[1] * scale);
+    std::normal_distribution<double> noise_t(0.0, std[2] * scale);
+    for(size_t i=0; i<num_particles; i++) {
+      noise_[3*i] = noise_x(gen_);
+      noise_[3*i+1] = noise_y(gen_);
+      noise_[3*i+2] = noise_t(gen_);
+    }
+    return;
+  }
+
+  uint32_t seed = static_cast<uint32_t>(gen_());
+  size_t num_blocks = (num_particles + NOISE_BLOCK - 1) / NOISE_BLOCK;
+  forRanges(num_blocks, [&](size_t begin, size_t end) {
+    for(size_t b=begin; b<end; b++) {
+      std::seed_seq seq{seed, static_cast<uint32_t>(b)};
+      std::default_random_engine gen(seq);
+      std::normal_distribution<double> noise_x(0.0, std[0] * scale);
+      std::normal_distribution<double> noise_y(0.0, std[1] * scale);
+      std::normal_distribution<double> noise_t(0.0, std[2] * scale);
+      for(size_t i=b * NOISE_BLOCK; i<std::min(num_particles, (b + 1) * NOISE_BLOCK); i++) {
+        noise_[3*i] = noise_x(gen);
+        noise_[3*i+1] = noise_y(gen);
+        noise_[3*i+2] = noise_t(gen);
+      }
+    }
+  });
+}
+
 void ParticleFilter::prediction(double delta_t, double velocity, double yaw_rate, double std[]) {
-  // define normal distributions for sensor noise
-  std::normal_distribution<double> noise_x(0.0, std[0]);
-  std::normal_distribution<double> noise_y(0.0, std[1]);
-  std::normal_distribution<double> noise_t(0.0, std[2]);
+  // draw the noise up front, the generator is sequential but the motion is not
+  drawNoise(std, 1.0);
 
-  for(int i=0; i<num_particles_; i++) {
-    if(std::abs(yaw_rate) > 0.00001) { // non-zero yaw rate
-      particles_[i].theta += yaw_rate * delta_t;
-      particles_[i].x += velocity / yaw_rate * (std::sin(particles_[i].theta + yaw_rate * delta_t) -
-                                                std::sin(particles_[i].theta));
+  // constant turn rate and velocity expanded with the angle sum identities:
+  //   dx = k * (a * cos(theta) - b * sin(theta))
+  //   dy = k * (a * sin(theta) + b * cos(theta))
+  // with the cached cos/sin of the heading, which then turns by dtheta plus the noise,
+  // so the loop has no trigonometric calls
+  double dtheta = yaw_rate * delta_t;
+  double cos_d = std::cos(dtheta);
+  double sin_d = std::sin(dtheta);
+  double k, a, b;
+  if(std::abs(yaw_rate) > 0.00001) { // non-zero yaw rate
+    k = velocity / yaw_rate;
+    a = std::sin(dtheta);
+    b = 1 - std::cos(dtheta);
+  } else { // zero yaw rate
+    k = velocity * delta_t;
+    a = 1;
+    b = 0;
+  }
+  forRanges(particles_.size(), [&](size_t begin, size_t end) {
+    for(size_t i=begin; i<end; i++) {
+      state_t& p = particles_[i];
+      double c = p.cos_t;
+      double s = p.sin_t;
+      p.x += k * (a * c - b * s) + noise_[3*i];
+      p.y += k * (a * s + b * c) + noise_[3*i+1];
+      p.theta = std::fmod(p.theta + dtheta + noise_[3*i+2], 2*M_PI);
+      rotate(p.cos_t, p.sin_t, cos_d, sin_d, noise_[3*i+2]);
+    }
+  });
+}
+
+namespace {
+
+// weighted moments of a range of particles, relative to a reference particle
+struct moments_t {
+  size_t best_index;
+  double best_weight;
+  double w, x, y, t, sin_t, cos_t;   // sums of w, w*dx, w*dy, w*dt, w*sin(theta), w*cos(theta)
+  double xx, xy, xt, yy, yt, tt;     // sums of the weighted products of dx, dy, dt
+
+  void merge(const moments_t& o) {
+    // ties go to the lower index, so the result doesn't depend on the chunking
+    if(o.best_weight > best_weight || (o.best_weight == best_weight && o.best_index < best_index)) {
+      best_weight = o.best_weight;
+      best_index = o.best_index;
+    }
+    w += o.w; x += o.x; y += o.y; t += o.t; sin_t += o.sin_t; cos_t += o.cos_t;
+    xx += o.xx; xy += o.xy; xt += o.xt; yy += o.yy; yt += o.yt; tt += o.tt;
+  }
+};
+
+// particles per moment sum, fixed so the summation order doesn't depend on the thread count
+const size_t MOMENT_CHUNK = 4096;
+
+}
+
+pose_estimate_t ParticleFilter::estimate() const {
+  pose_estimate_t e{};
+  if(particles_.empty()) {
+    return e;
+  }
+
+  // deviations from the first particle keep the second moments well conditioned
+  const state_t& ref = particles_[0];
+  size_t num_chunks = (particles_.size() + MOMENT_CHUNK - 1) / MOMENT_CHUNK;
+  std::vector<moments_t> chunks(num_chunks);
+  auto reduce = [&](size_t c) {
+    moments_t& m = chunks[c];
+    m = moments_t{};
+    m.best_weight = -1.0;
+    for(size_t i=c * MOMENT_CHUNK; i<std::min(particles_.size(), (c + 1) * MOMENT_CHUNK); i++) {
+      const state_t& p = particles_[i];
+      double w = p.weight;
+      if(w > m.best_weight) {
+        m.best_weight = w;
+        m.best_index = i;
+      }
+      double dx = p.x - ref.x;
+      double dy = p.y - ref.y;
+      double dt = std::remainder(p.theta - ref.theta, 2*M_PI);
+      m.w += w;
+      m.x += w * dx;
+      m.y += w * dy;
+      m.t += w * dt;
+      m.sin_t += w * p.sin_t;
+      m.cos_t += w * p.cos_t;
+      m.xx += w * dx * dx;
+      m.xy += w * dx * dy;
+      m.xt += w * dx * dt;
+      m.yy += w * dy * dy;
+      m.yt += w * dy * dt;
+      m.tt += w * dt * dt;
+    }
+  };
+  if(pool_ && num_chunks > 1) {
+    pool_->parallel_for(num_chunks, [&](size_t begin, size_t end) {
+      for(size_t c=begin; c<end; c++) {
+        reduce(c);
+      }
+    });
+  } else {
+    for(size_t c=0; c<num_chunks; c++) {
+      reduce(c);
+    }
+  }
+  // merged in chunk order, reproducible for any pool
+  moments_t total = chunks[0];
+  for(size_t c=1; c<num_chunks; c++) {
+    total.merge(chunks[c]);
+  }
+
+  e.best_index = total.best_index;
+  e.best_weight = total.best_weight;
+  e.weight_sum = total.w;
+  if(total.w <= 0) {
+    e.mean = pose_t{ref.x, ref.y, ref.theta};
+    return e;
+  }
+  double mx = total.x / total.w;
+  double my = total.y / total.w;
+  double mt = total.t / total.w;
+  e.mean = pose_t{ref.x + mx, ref.y + my, std::atan2(total.sin_t, total.cos_t)};
+
+  double cxx = total.xx / total.w - mx * mx;
+  double cxy = total.xy / total.w - mx * my;
+  double cxt = total.xt / total.w - mx * mt;
+  double cyy = total.yy / total.w - my * my;
+  double cyt = total.yt / total.w - my * mt;
+  double ctt = total.tt / total.w - mt * mt;
+  double covariance[9] = {cxx, cxy, cxt,
+                          cxy, cyy, cyt,
+                          cxt, cyt, ctt};
+  std::copy(covariance, covariance + 9, e.covariance);
+  return e;
+}
+
+void ParticleFilter::predictMotion(const pose_t& motion, double std[], size_t steps) {
+  // independent noise per step adds up in variance
+  drawNoise(std, std::sqrt(static_cast<double>(steps)));
+
+  double cos_d = std::cos(motion.theta);
+  double sin_d = std::sin(motion.theta);
+  forRanges(particles_.size(), [&](size_t begin, size_t end) {
+    for(size_t i=begin; i<end; i++) {
+      state_t& p = particles_[i];
+      double c = p.cos_t;
+      double s = p.sin_t;
+      p.x += c * motion.x - s * motion.y + noise_[3*i];
+      p.y += s * motion.x + c * motion.y + noise_[3*i+1];
+      p.theta = std::fmod(p.theta + motion.theta + noise_[3*i+2], 2*M_PI);
+      rotate(p.cos_t, p.sin_t, cos_d, sin_d, noise_[3*i+2]);
+    }
+  });
+}
+
+namespace {
+
+// edge length of the grid cells particles are clustered by [m]
+const double CLUSTER_SIZE = 2.0;
+
+// the region of interest is only copied while it holds at most this share of the map
+const double MAX_ROI_SHARE = 0.5;
+
+// clusters are looked up in a dense grid while it has at most this many cells per particle
+const size_t DENSE_CLUSTER_CELLS = 4;
+
+// one double per particle of a block, operations apply to all lanes (GCC/Clang vector extension)
+template<size_t LANES>
+struct vec {
+  typedef double type __attribute__((vector_size(LANES * sizeof(double))));
+};
+
+// particle poses of a block in structure-of-arrays layout, one particle per lane
+template<size_t LANES>
+struct lanes_t {
+  typename vec<LANES>::type x;
+  typename vec<LANES>::type y;
+  typename vec<LANES>::type cos_t;
+  typename vec<LANES>::type sin_t;
+};
+
+// an observation transformed and associated in every lane
+template<size_t LANES>
+struct association_t {
+  typename vec<LANES>::type t_x;    // observation in map coordinates
+  typename vec<LANES>::type t_y;
+  typename vec<LANES>::type l_x;    // associated landmark, (0, 0) if there is none
+  typename vec<LANES>::type l_y;
+  typename vec<LANES>::type index;  // candidate index of the landmark, -1 if there is none
+};
+
+/*
+ * Loads the poses of count particles with their cached heading cos/sin into
+ * lanes, unused lanes repeat the last particle so every lane computes valid values
+ */
+template<size_t LANES, class particle_type>
+void load_lanes(const particle_type* particles, const uint32_t* members, size_t count, lanes_t<LANES>& lanes) {
+  for(size_t l=0; l<LANES; l++) {
+    const particle_type& p = particles[members[std::min(l, count - 1)]];
+    lanes.x[l] = p.x;
+    lanes.y[l] = p.y;
+    lanes.cos_t[l] = p.cos_t;
+    lanes.sin_t[l] = p.sin_t;
+  }
+}
+
+/*
+ * Transforms an observation into map coordinates for all lanes and
+ * associates it with the nearest candidate within sensor range of each
+ * particle. Candidates are broadcast to all lanes and the lanes select
+ * instead of branching, so each candidate costs a few vector instructions.
+ */
+template<size_t LANES>
+void associate_lanes(const lanes_t<LANES>& lanes, const landmark_t& obs, const landmark_t* candidates,
+                     size_t num_candidates, double range2, association_t<LANES>& a) {
+  typedef typename vec<LANES>::type vec_t;
+  vec_t t_x = lanes.cos_t * obs.x - lanes.sin_t * obs.y + lanes.x;
+  vec_t t_y = lanes.sin_t * obs.x + lanes.cos_t * obs.y + lanes.y;
+  vec_t zero = t_x - t_x;
+  vec_t l_x = zero;
+  vec_t l_y = zero;
+  vec_t index = zero - 1.0;
+  vec_t minimum = zero + std::numeric_limits<double>::infinity();
+  for(size_t j=0; j<num_candidates; j++) {
+    double c_x = candidates[j].x;
+    double c_y = candidates[j].y;
+    vec_t r_x = c_x - lanes.x;
+    vec_t r_y = c_y - lanes.y;
+    vec_t d_x = t_x - c_x;
+    vec_t d_y = t_y - c_y;
+    // out of range candidates are infinitely far
+    vec_t d2 = r_x * r_x + r_y * r_y <= range2 ? d_x * d_x + d_y * d_y : zero + std::numeric_limits<double>::infinity();
+    auto nearer = d2 < minimum;
+    minimum = nearer ? d2 : minimum;
+    l_x = nearer ? zero + c_x : l_x;
+    l_y = nearer ? zero + c_y : l_y;
+    index = nearer ? zero + static_cast<double>(j) : index;
+  }
+  a.t_x = t_x;
+  a.t_y = t_y;
+  a.l_x = l_x;
+  a.l_y = l_y;
+  a.index = index;
+}
 
-      particles_[i].y += velocity / yaw_rate * (std::cos(particles_[i].theta) -
-                                                std::cos(particles_[i].theta + yaw_rate * delta_t));
-    } else { // zero yaw rate
-      particles_[i].x += velocity * delta_t * std::cos(particles_[i].theta);
-      particles_[i].y += velocity * delta_t * std::sin(particles_[i].theta);
+// landmark id of an associated candidate index
+inline int association_id(const landmark_t* candidates, double index) {
+  return index < 0 ? -1 : candidates[static_cast<size_t>(index)].id;
+}
+
+// observation indices nearest first, their association is the most reliable
+std::vector<size_t> nearest_first(const std::vector<landmark_t>& observations) {
+  std::vector<size_t> order(observations.size());
+  for(size_t k=0; k<order.size(); k++) {
+    order[k] = k;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return observations[a].x * observations[a].x + observations[a].y * observations[a].y <
+           observations[b].x * observations[b].x + observations[b].y * observations[b].y;
+  });
+  return order;
+}
+
+}
+
+void ParticleFilter::buildCandidates(double sensor_range, const map_view_t &map) {
+  candidates_t& sets = candidates_;
+  sets.landmarks.clear();
+  sets.start.clear();
+  sets.members.resize(particles_.size());
+  sets.blocks.clear();
+  if(particles_.empty()) {
+    sets.start.push_back(0);
+    return;
+  }
+
+  // frame region of interest: every landmark any particle can observe
+  bbox_t box = bounds();
+  bbox_t roi{box.min_x - sensor_range, box.min_y - sensor_range, box.max_x + sensor_range, box.max_y + sensor_range};
+  double roi_x = (roi.min_x + roi.max_x) / 2;
+  double roi_y = (roi.min_y + roi.max_y) / 2;
+  std::vector<landmark_t> roi_landmarks;
+  map.for_each_in_range(roi_x, roi_y, dist(roi_x, roi_y, roi.max_x, roi.max_y), [&](uint32_t i) {
+    landmark_t l = map.landmark(i);
+    if(l.x >= roi.min_x && l.x <= roi.max_x && l.y >= roi.min_y && l.y <= roi.max_y) {
+      roi_landmarks.push_back(l);
     }
-    particles_[i].x += noise_x(gen_);
-    particles_[i].y += noise_y(gen_);
-    particles_[i].theta = std::fmod(particles_[i].theta + noise_t(gen_), 2*M_PI);
+  });
+  // a compact copy keeps the cluster queries in cache, unless the particles cover most of the map
+  std::unique_ptr<LandmarkMap> roi_map;
+  if(roi_landmarks.size() <= map.count * MAX_ROI_SHARE) {
+    roi_map.reset(new LandmarkMap(roi_landmarks));
   }
+  const map_view_t& source = roi_map ? roi_map->view() : map;
+
+  // clusters are the occupied cells of a grid over the particles, numbered in order of appearance
+  std::vector<std::pair<double, double>> centers;
+  std::vector<uint32_t> cluster(particles_.size());
+  uint64_t cols = static_cast<uint64_t>((box.max_x - box.min_x) / CLUSTER_SIZE) + 1;
+  uint64_t rows = static_cast<uint64_t>((box.max_y - box.min_y) / CLUSTER_SIZE) + 1;
+  if(cols * rows <= std::max<uint64_t>(particles_.size() * DENSE_CLUSTER_CELLS, 1 << 16)) {
+    // cells of the particles in parallel, then a dense cell to cluster table
+    forRanges(particles_.size(), [&](size_t begin, size_t end) {
+      for(size_t i=begin; i<end; i++) {
+        uint64_t col = static_cast<uint64_t>((particles_[i].x - box.min_x) / CLUSTER_SIZE);
+        uint64_t row = static_cast<uint64_t>((particles_[i].y - box.min_y) / CLUSTER_SIZE);
+        cluster[i] = static_cast<uint32_t>(row * cols + col);
+      }
+    });
+    const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> cell_cluster(cols * rows, NONE);
+    for(auto& c : cluster) {
+      uint32_t& id = cell_cluster[c];
+      if(id == NONE) {
+        id = static_cast<uint32_t>(centers.size());
+        centers.push_back(std::make_pair(box.min_x + (c % cols + 0.5) * CLUSTER_SIZE,
+                                         box.min_y + (c / cols + 0.5) * CLUSTER_SIZE));
+      }
+      c = id;
+    }
+  } else {
+    // sparse particles over a large region
+    std::unordered_map<uint64_t, uint32_t> clusters;
+    for(size_t i=0; i<particles_.size(); i++) {
+      uint64_t col = static_cast<uint64_t>((particles_[i].x - box.min_x) / CLUSTER_SIZE);
+      uint64_t row = static_cast<uint64_t>((particles_[i].y - box.min_y) / CLUSTER_SIZE);
+      auto inserted = clusters.insert(std::make_pair(row << 32 | col, static_cast<uint32_t>(centers.size())));
+      if(inserted.second) {
+        centers.push_back(std::make_pair(box.min_x + (col + 0.5) * CLUSTER_SIZE, box.min_y + (row + 0.5) * CLUSTER_SIZE));
+      }
+      cluster[i] = inserted.first->second;
+    }
+  }
+
+  // members ordered by cluster (counting sort), split into blocks of LANES
+  std::vector<uint32_t> offset(centers.size() + 1, 0);
+  for(auto c : cluster) {
+    offset[c + 1]++;
+  }
+  for(size_t c=0; c<centers.size(); c++) {
+    for(uint32_t begin=offset[c]; begin<offset[c] + offset[c + 1]; begin+=LANES) {
+      sets.blocks.push_back(block_t{static_cast<uint32_t>(c), begin,
+                                    std::min<uint32_t>(begin + LANES, offset[c] + offset[c + 1])});
+    }
+    offset[c + 1] += offset[c];
+  }
+  for(size_t i=0; i<particles_.size(); i++) {
+    sets.members[offset[cluster[i]]++] = static_cast<uint32_t>(i);
+  }
+
+  // every landmark within sensor range of any point of the cell
+  double radius = sensor_range + CLUSTER_SIZE * M_SQRT1_2;
+  for(auto const& center : centers) {
+    sets.start.push_back(static_cast<uint32_t>(sets.landmarks.size()));
+    source.for_each_in_range(center.first, center.second, radius, [&](uint32_t i) {
+      sets.landmarks.push_back(source.landmark(i));
+    });
+  }
+  sets.start.push_back(static_cast<uint32_t>(sets.landmarks.size()));
 }
 
 void ParticleFilter::updateWeights(double sensor_range, double std_landmark[],
                                    const std::vector<landmark_t> &observations,
-                                   const std::vector<landmark_t> &map_landmarks) {
-  for(auto& p : particles_) {
-    // get all landmarks within range
-    std::vector<landmark_t> predictions;
-    for(auto const& landmark : map_landmarks) {
-      if(dist(landmark.x, landmark.y, p.x, p.y) <= sensor_range) {
-        predictions.push_back(landmark);
-      }
-    }
-
-    // convert observations from vehicle to global coods
-    std::vector<landmark_t> map_observations;
-    for(auto const& obs : observations) {
-      // 2D transformation matrix with particle theta and position
-      double t_x = std::cos(p.theta) * obs.x - std::sin(p.theta) * obs.y + p.x;
-      double t_y = std::sin(p.theta) * obs.x + std::cos(p.theta) * obs.y + p.y;
-      map_observations.push_back(landmark_t{obs.id, t_x, t_y});
-    }
-
-    // perform associations between landmarks and observations
-    // updates map_observations with associations
-    dataAssociation(predictions, map_observations);
-
-    // update association debug structures
-    p.associations.clear();
-    p.sense_x.clear();
-    p.sense_y.clear();
-    for(auto const& obs : map_observations) {
-      p.associations.push_back(obs.id);
-      p.sense_x.push_back(obs.x);
-      p.sense_y.push_back(obs.y);
-    }
-
-    // calculate weights
-    p.weight = 1.0;
-    for(auto const& obs : map_observations) {
-      // get associated prediction
-      landmark_t prediction{};
-      for(auto const& pred : predictions) {
-        if(pred.id == obs.id) {
-          prediction = pred;
+                                   const map_view_t &map) {
+  buildCandidates(sensor_range, map);
+  double range2 = sensor_range * sensor_range;
+  double norm = -std::log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  double scale_x = 1.0 / (2 * std_landmark[0] * std_landmark[0]);
+  double scale_y = 1.0 / (2 * std_landmark[1] * std_landmark[1]);
+  resizeAssociations(observations.size());
+  associations_.count = observations.size();
+
+  // blocks are independent, so ranges of them can be updated concurrently
+  auto update = [&](size_t begin, size_t end) {
+    lanes_t<LANES> lanes;
+    association_t<LANES> a;
+    for(size_t b=begin; b<end; b++) {
+      const block_t& block = candidates_.blocks[b];
+      const uint32_t* members = &candidates_.members[block.begin];
+      size_t count = block.end - block.begin;
+      const landmark_t* candidates = candidates_.landmarks.data() + candidates_.start[block.cluster];
+      size_t num_candidates = candidates_.start[block.cluster + 1] - candidates_.start[block.cluster];
+      load_lanes(particles_.data(), members, count, lanes);
+
+      double log_weight[LANES] = {};
+      for(size_t k=0; k<observations.size(); k++) {
+        // associate the nearest landmark in range and add the log likelihood
+        associate_lanes(lanes, observations[k], candidates, num_candidates, range2, a);
+        for(size_t l=0; l<LANES; l++) {
+          double d_x = a.t_x[l] - a.l_x[l];
+          double d_y = a.t_y[l] - a.l_y[l];
+          log_weight[l] += norm - d_x * d_x * scale_x - d_y * d_y * scale_y;
+        }
+        for(size_t l=0; l<count; l++) {
+          size_t entry = members[l] * associations_.stride + k;
+          associations_.ids[entry] = association_id(candidates, a.index[l]);
+          associations_.sense_x[entry] = a.t_x[l];
+          associations_.sense_y[entry] = a.t_y[l];
+        }
+      }
+      for(size_t l=0; l<count; l++) {
+        particles_[members[l]].weight = std::exp(log_weight[l]);
+        particles_[members[l]].row = members[l];
+      }
+    }
+  };
+
+  if(pool_) {
+    pool_->parallel_for(candidates_.blocks.size(), update);
+  } else {
+    update(0, candidates_.blocks.size());
+  }
+}
+
+size_t ParticleFilter::updateWeightsAnytime(double sensor_range, double std_landmark[],
+                                            const std::vector<landmark_t> &observations,
+                                            const map_view_t &map, uint64_t deadline_ns) {
+  // particles between two deadline checks: a clock read costs some 20-50 ns, weighting 64 particles
+  // by an observation a few us, so the checks stay around 1% of the update and overshoot the deadline
+  // by a few us at most; counted in blocks of LANES particles (blocks at cluster ends may hold fewer)
+  const size_t CHECK_PARTICLES = 64;
+  const size_t CHUNK = std::max<size_t>(1, CHECK_PARTICLES / LANES);
+  size_t num_particles = particles_.size();
+  std::atomic<bool> expired(false);
+
+  // runs body on all particle blocks in chunks, false if the deadline hit first
+  auto for_all = [&](const std::function<void(size_t)>& body) {
+    auto run = [&](size_t begin, size_t end) {
+      for(size_t i=begin; i<end && !expired.load(std::memory_order_relaxed); i+=CHUNK) {
+        if(now_ns() >= deadline_ns) {
+          expired.store(true, std::memory_order_relaxed);
+          break;
         }
+        for(size_t j=i; j<std::min(end, i + CHUNK); j++) {
+          body(j);
+        }
+      }
+    };
+    if(pool_) {
+      pool_->parallel_for(candidates_.blocks.size(), run);
+    } else {
+      run(0, candidates_.blocks.size());
+    }
+    return !expired.load(std::memory_order_relaxed);
+  };
+
+  // nearest observations first, their association is the most reliable
+  std::vector<size_t> order = nearest_first(observations);
+
+  // landmarks within range of the particles' clusters
+  buildCandidates(sensor_range, map);
+  double range2 = sensor_range * sensor_range;
+  bool complete = true;
+
+  // observation k of the order goes to column k, columns past the used ones are ignored
+  resizeAssociations(observations.size());
+  for(size_t i=0; i<num_particles; i++) {
+    particles_[i].row = static_cast<uint32_t>(i);
+  }
+
+  // log likelihood per particle and of the observation in progress
+  std::vector<double> log_weights(num_particles, 0.0);
+  std::vector<double> log_likelihood(num_particles);
+  double norm = -std::log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  double scale_x = 1.0 / (2 * std_landmark[0] * std_landmark[0]);
+  double scale_y = 1.0 / (2 * std_landmark[1] * std_landmark[1]);
+
+  size_t used = 0;
+  for(size_t k=0; complete && k<order.size(); k++) {
+    const landmark_t& obs = observations[order[k]];
+    complete = for_all([&](size_t b) {
+      const block_t& block = candidates_.blocks[b];
+      const uint32_t* members = &candidates_.members[block.begin];
+      size_t count = block.end - block.begin;
+      const landmark_t* candidates = candidates_.landmarks.data() + candidates_.start[block.cluster];
+      lanes_t<LANES> lanes;
+      association_t<LANES> a;
+      // transform to map coordinates and associate the nearest landmark
+      load_lanes(particles_.data(), members, count, lanes);
+      associate_lanes(lanes, obs, candidates, candidates_.start[block.cluster + 1] - candidates_.start[block.cluster],
+                      range2, a);
+      for(size_t l=0; l<count; l++) {
+        double d_x = a.t_x[l] - a.l_x[l];
+        double d_y = a.t_y[l] - a.l_y[l];
+        log_likelihood[members[l]] = norm - d_x * d_x * scale_x - d_y * d_y * scale_y;
+        size_t entry = members[l] * associations_.stride + k;
+        associations_.ids[entry] = association_id(candidates, a.index[l]);
+        associations_.sense_x[entry] = a.t_x[l];
+        associations_.sense_y[entry] = a.t_y[l];
       }
-      // update weight
-      p.weight *= gaussian2d(obs.x, obs.y, prediction.x, prediction.y, std_landmark[0], std_landmark[1]);
+    });
+    if(!complete) {
+      break;
     }
+    for(size_t i=0; i<num_particles; i++) {
+      log_weights[i] += log_likelihood[i];
+    }
+    used++;
+  }
+  associations_.count = used;
+
+  // relative to the best particle, so the weights cannot all underflow
+  double max_log_weight = num_particles ? *std::max_element(log_weights.begin(), log_weights.end()) : 0.0;
+  for(size_t i=0; i<num_particles; i++) {
+    particles_[i].weight = std::exp(log_weights[i] - max_log_weight);
   }
+  return used;
+}
+
+size_t ParticleFilter::updateWeightsTwoStage(double sensor_range, double std_landmark[],
+                                             const std::vector<landmark_t> &observations,
+                                             const map_view_t &map, size_t coarse_observations,
+                                             double fine_fraction) {
+  size_t num_particles = particles_.size();
+  size_t coarse = std::min(coarse_observations, observations.size());
+  if(coarse == 0 || coarse == observations.size() || fine_fraction >= 1.0) {
+    updateWeights(sensor_range, std_landmark, observations, map);
+    return num_particles;
+  }
+
+  std::vector<size_t> order = nearest_first(observations);
+  buildCandidates(sensor_range, map);
+  double range2 = sensor_range * sensor_range;
+  double norm = -std::log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  double scale_x = 1.0 / (2 * std_landmark[0] * std_landmark[0]);
+  double scale_y = 1.0 / (2 * std_landmark[1] * std_landmark[1]);
+
+  // observation k of the order goes to column k
+  resizeAssociations(observations.size());
+  associations_.count = observations.size();
+  std::vector<double> log_weights(num_particles, 0.0);
+
+  // adds the log likelihoods of the observations [first, last) of the order for the members of a block
+  auto evaluate = [&](const block_t& block, size_t first, size_t last) {
+    const uint32_t* members = &candidates_.members[block.begin];
+    size_t count = block.end - block.begin;
+    const landmark_t* candidates = candidates_.landmarks.data() + candidates_.start[block.cluster];
+    size_t num_candidates = candidates_.start[block.cluster + 1] - candidates_.start[block.cluster];
+    lanes_t<LANES> lanes;
+    association_t<LANES> a;
+    load_lanes(particles_.data(), members, count, lanes);
+    double log_weight[LANES] = {};
+    for(size_t k=first; k<last; k++) {
+      associate_lanes(lanes, observations[order[k]], candidates, num_candidates, range2, a);
+      for(size_t l=0; l<LANES; l++) {
+        double d_x = a.t_x[l] - a.l_x[l];
+        double d_y = a.t_y[l] - a.l_y[l];
+        log_weight[l] += norm - d_x * d_x * scale_x - d_y * d_y * scale_y;
+      }
+      for(size_t l=0; l<count; l++) {
+        size_t entry = members[l] * associations_.stride + k;
+        associations_.ids[entry] = association_id(candidates, a.index[l]);
+        associations_.sense_x[entry] = a.t_x[l];
+        associations_.sense_y[entry] = a.t_y[l];
+      }
+    }
+    for(size_t l=0; l<count; l++) {
+      log_weights[members[l]] += log_weight[l];
+    }
+  };
+
+  // coarse stage: every particle against the nearest observations
+  forRanges(candidates_.blocks.size(), [&](size_t begin, size_t end) {
+    for(size_t b=begin; b<end; b++) {
+      evaluate(candidates_.blocks[b], 0, coarse);
+    }
+  });
+
+  // coarse log weight the best fine_fraction of the particles reach
+  size_t fine = std::min(num_particles, std::max<size_t>(1, static_cast<size_t>(std::ceil(fine_fraction * num_particles))));
+  std::vector<double> ranked(log_weights);
+  std::nth_element(ranked.begin(), ranked.begin() + (fine - 1), ranked.end(), std::greater<double>());
+  double threshold = ranked[fine - 1];
+
+  // fine stage: blocks with a particle at the threshold get the remaining observations,
+  // the others extrapolate their coarse log weight
+  double extrapolate = static_cast<double>(observations.size()) / coarse;
+  std::atomic<size_t> refined(0);
+  forRanges(candidates_.blocks.size(), [&](size_t begin, size_t end) {
+    size_t count_refined = 0;
+    for(size_t b=begin; b<end; b++) {
+      const block_t& block = candidates_.blocks[b];
+      const uint32_t* members = &candidates_.members[block.begin];
+      size_t count = block.end - block.begin;
+      bool refine = false;
+      for(size_t l=0; l<count; l++) {
+        refine = refine || log_weights[members[l]] >= threshold;
+      }
+      if(refine) {
+        evaluate(block, coarse, observations.size());
+        count_refined += count;
+      }
+      for(size_t l=0; l<count; l++) {
+        state_t& p = particles_[members[l]];
+        p.weight = std::exp(refine ? log_weights[members[l]] : log_weights[members[l]] * extrapolate);
+        p.row = members[l] | (refine ? 0 : COARSE_ROW);
+      }
+    }
+    refined += count_refined;
+  });
+  associations_.coarse = coarse;
+  return refined;
 }
 
 void ParticleFilter::dataAssociation(std::vector<landmark_t> predicted, std::vector<landmark_t> &observations) {
@@ -111,45 +751,396 @@ void ParticleFilter::dataAssociation(std::vector<landmark_t> predicted, std::vec
   }
 }
 
+namespace {
+
+// offspring per independently seeded slice of the parallel resamplers
+const size_t RESAMPLE_SLICE = 4096;
+
+// proposals per offspring of the Metropolis resampler
+const int METROPOLIS_STEPS = 32;
+
+}
+
 void ParticleFilter::resample() {
-  // using resampling wheel method
-  std::vector<particle_t> new_particles;
+  if(particles_.empty()) {
+    return;
+  }
+  ancestors_.resize(num_particles_);
+  switch(resampler_) {
+    case Resampler::SYSTEMATIC:
+      resampleSystematic();
+      break;
+    case Resampler::METROPOLIS:
+      resampleMetropolis();
+      break;
+    default:
+      resampleWheel();
+      break;
+  }
 
-  std::vector<double> weights;
+  // gather the offspring into the second buffer, their associations stay where they are
+  resampled_.resize(ancestors_.size());
+  forRanges(resampled_.size(), [&](size_t begin, size_t end) {
+    for(size_t k=begin; k<end; k++) {
+      resampled_[k] = particles_[ancestors_[k]];
+    }
+  });
+  particles_.swap(resampled_);
+}
+
+void ParticleFilter::resampleWheel() {
+  // using resampling wheel method
+  double max_weight = particles_[0].weight;
   for(auto const& p : particles_) {
-    weights.push_back(p.weight);
+    max_weight = std::max(max_weight, p.weight);
   }
-  double max_weight = *max_element(weights.begin(), weights.end());
   std::uniform_real_distribution<double> uniformdist_weight(0.0, 2 * max_weight);
 
   // generate random starting index for resampling wheel
-  std::uniform_int_distribution<int> uniformdist_index(0, num_particles_-1);
+  // (the particle count may have changed since the last resample)
+  int count = static_cast<int>(particles_.size());
+  std::uniform_int_distribution<int> uniformdist_index(0, count-1);
   auto index = uniformdist_index(gen_);
 
   double beta = 0;
-  for(int i=0; i<num_particles_; i++) {
+  for(size_t k=0; k<ancestors_.size(); k++) {
     beta += uniformdist_weight(gen_);
-    while(weights[index] < beta) {
-      beta -= weights[index];
-      index = (index + 1) % num_particles_;
+    while(particles_[index].weight < beta) {
+      beta -= particles_[index].weight;
+      index = (index + 1) % count;
     }
-    new_particles.push_back(particles_[index]);
+    ancestors_[k] = index;
   }
-  particles_ = new_particles;
 }
 
-particle_t ParticleFilter::get_best_particle() {
-  double highest_weight = -1.0;
-  particle_t best_particle{};
-  double weight_sum = 0.0;
-  for (auto const& p : particles_) {
-    if (p.weight > highest_weight) {
-      highest_weight = p.weight;
-      best_particle = p;
+void ParticleFilter::resampleSystematic() {
+  size_t count = particles_.size();
+  size_t num_slices = (count + RESAMPLE_SLICE - 1) / RESAMPLE_SLICE;
+
+  // weight sum per slice of the particles, then their exclusive prefix sum
+  if(resample_weights_.size() < num_slices + 1) {
+    resample_weights_.resize(num_slices + 1);
+  }
+  std::vector<double>& prefix = resample_weights_;
+  prefix[0] = 0.0;
+  forRanges(num_slices, [&](size_t begin, size_t end) {
+    for(size_t s=begin; s<end; s++) {
+      double sum = 0.0;
+      for(size_t i=s * RESAMPLE_SLICE; i<std::min(count, (s + 1) * RESAMPLE_SLICE); i++) {
+        sum += particles_[i].weight;
+      }
+      prefix[s + 1] = sum;
     }
-    weight_sum += p.weight;
+  });
+  for(size_t s=0; s<num_slices; s++) {
+    prefix[s + 1] += prefix[s];
+  }
+  // without any weight every particle is equally likely
+  bool uniform = !(prefix[num_slices] > 0);
+  auto weight = [&](size_t i) {
+    return uniform ? 1.0 : particles_[i].weight;
+  };
+  if(uniform) {
+    for(size_t s=0; s<=num_slices; s++) {
+      prefix[s] = static_cast<double>(std::min(count, s * RESAMPLE_SLICE));
+    }
+  }
+
+  // offspring k is the particle the cumulative weight (k + u) * total / n falls on
+  size_t num_offspring = ancestors_.size();
+  double step = prefix[num_slices] / num_offspring;
+  double u = std::uniform_real_distribution<double>(0.0, 1.0)(gen_);
+  auto first_offspring = [&](double cumulative) {
+    double k = std::ceil(cumulative / step - u);
+    return static_cast<size_t>(std::min(static_cast<double>(num_offspring), std::max(0.0, k)));
+  };
+
+  // every slice emits the offspring falling on its cumulative weight range
+  forRanges(num_slices, [&](size_t begin, size_t end) {
+    for(size_t s=begin; s<end; s++) {
+      size_t i = s * RESAMPLE_SLICE;
+      size_t last = std::min(count, (s + 1) * RESAMPLE_SLICE) - 1;
+      double cumulative = prefix[s] + weight(i);
+      for(size_t k=first_offspring(prefix[s]); k<first_offspring(prefix[s + 1]); k++) {
+        double target = (k + u) * step;
+        while(cumulative <= target && i < last) {
+          cumulative += weight(++i);
+        }
+        ancestors_[k] = static_cast<uint32_t>(i);
+      }
+    }
+  });
+}
+
+void ParticleFilter::resampleMetropolis() {
+  size_t count = particles_.size();
+  size_t num_offspring = ancestors_.size();
+  size_t num_slices = (num_offspring + RESAMPLE_SLICE - 1) / RESAMPLE_SLICE;
+
+  // contiguous weights for the random accesses of the chains
+  if(resample_weights_.size() < count) {
+    resample_weights_.resize(count);
+  }
+  std::vector<double>& weights = resample_weights_;
+  forRanges(count, [&](size_t begin, size_t end) {
+    for(size_t i=begin; i<end; i++) {
+      weights[i] = particles_[i].weight;
+    }
+  });
+
+  // slices get their own generator, so the result does not depend on the thread count
+  if(resample_seeds_.size() < num_slices) {
+    resample_seeds_.resize(num_slices);
+  }
+  std::vector<uint32_t>& seeds = resample_seeds_;
+  for(size_t s=0; s<num_slices; s++) {
+    seeds[s] = static_cast<uint32_t>(gen_());
+  }
+
+  // a chain per offspring accepts a uniform proposal j over its state i with probability w_j / w_i
+  forRanges(num_slices, [&](size_t begin, size_t end) {
+    std::uniform_int_distribution<size_t> proposal(0, count - 1);
+    std::uniform_real_distribution<double> acceptance(0.0, 1.0);
+    for(size_t s=begin; s<end; s++) {
+      std::default_random_engine gen(seeds[s]);
+      for(size_t k=s * RESAMPLE_SLICE; k<std::min(num_offspring, (s + 1) * RESAMPLE_SLICE); k++) {
+        size_t i = k % count;
+        for(int b=0; b<METROPOLIS_STEPS; b++) {
+          size_t j = proposal(gen);
+          if(acceptance(gen) * weights[i] <= weights[j]) {
+            i = j;
+          }
+        }
+        ancestors_[k] = static_cast<uint32_t>(i);
+      }
+    }
+  });
+}
+
+void ParticleFilter::resizeAssociations(size_t stride) {
+  // grows only, so steady frames don't allocate
+  size_t size = particles_.size() * stride;
+  if(associations_.ids.size() < size) {
+    associations_.ids.resize(size);
+    associations_.sense_x.resize(size);
+    associations_.sense_y.resize(size);
+  }
+  associations_.stride = stride;
+  associations_.count = 0;
+  associations_.coarse = 0;
+}
+
+void ParticleFilter::forRanges(size_t count, const std::function<void(size_t, size_t)>& body) const {
+  if(pool_) {
+    pool_->parallel_for(count, body);
+  } else {
+    body(0, count);
+  }
+}
+
+particle_t ParticleFilter::get_best_particle() const {
+  if(particles_.empty()) {
+    return particle_t{};
+  }
+  size_t best = 0;
+  for(size_t i=1; i<particles_.size(); i++) {
+    if(particles_[i].weight > particles_[best].weight) {
+      best = i;
+    }
+  }
+  return particle(best);
+}
+
+particle_t ParticleFilter::particle(size_t index) const {
+  const state_t& s = particles_[index];
+  particle_t p{s.id, s.x, s.y, s.theta, s.weight, {}, {}, {}};
+  if(s.row != NO_ROW) {
+    size_t begin = (s.row & ~COARSE_ROW) * associations_.stride;
+    size_t end = begin + (s.row & COARSE_ROW ? associations_.coarse : associations_.count);
+    p.associations.assign(associations_.ids.begin() + begin, associations_.ids.begin() + end);
+    p.sense_x.assign(associations_.sense_x.begin() + begin, associations_.sense_x.begin() + end);
+    p.sense_y.assign(associations_.sense_y.begin() + begin, associations_.sense_y.begin() + end);
+  }
+  return p;
+}
+
+void ParticleFilter::save(std::ostream& out) const {
+  write_pod(out, static_cast<uint32_t>(particles_.size()));
+  write_pod(out, static_cast<uint8_t>(is_initialized_));
+  for(auto const& p : particles_) {
+    write_pod(out, static_cast<int32_t>(p.id));
+    write_pod(out, p.x);
+    write_pod(out, p.y);
+    write_pod(out, p.theta);
+    write_pod(out, p.cos_t);
+    write_pod(out, p.sin_t);
+    write_pod(out, p.weight);
+  }
+  // the standard only defines a text representation for engine states
+  std::ostringstream rng;
+  rng << gen_;
+  write_pod(out, static_cast<uint32_t>(rng.str().size()));
+  out << rng.str();
+}
+
+void ParticleFilter::load(std::istream& in, uint32_t version) {
+  if(version < 1 || version > STATE_VERSION) {
+    throw std::runtime_error("Unsupported filter state version " + std::to_string(version));
+  }
+  uint32_t count = 0;
+  uint8_t initialized = 0;
+  if(!read_pod(in, count) || !read_pod(in, initialized)) {
+    throw std::runtime_error("Truncated filter state");
+  }
+  // id, x, y, theta, (cos, sin,) weight per particle
+  const uint64_t particle_size = sizeof(int32_t) + (version < 2 ? 4 : 6) * sizeof(double);
+  if(count > stream_remaining(in) / particle_size) {
+    throw std::runtime_error("Truncated filter state");
+  }
+  std::vector<state_t> particles(count);
+  for(auto& p : particles) {
+    int32_t id = 0;
+    if(!read_pod(in, id) || !read_pod(in, p.x) || !read_pod(in, p.y) || !read_pod(in, p.theta)) {
+      throw std::runtime_error("Truncated filter state");
+    }
+    if(version < 2) {
+      p.setHeading(p.theta);
+    } else if(!read_pod(in, p.cos_t) || !read_pod(in, p.sin_t)) {
+      throw std::runtime_error("Truncated filter state");
+    }
+    if(!read_pod(in, p.weight)) {
+      throw std::runtime_error("Truncated filter state");
+    }
+    p.id = id;
+    p.row = NO_ROW;
   }
-  return best_particle;
+  uint32_t rng_size = 0;
+  if(!read_pod(in, rng_size) || rng_size > stream_remaining(in)) {
+    throw std::runtime_error("Truncated filter state");
+  }
+  std::string rng(rng_size, ' ');
+  if(!in.read(&rng[0], rng_size)) {
+    throw std::runtime_error("Truncated filter state");
+  }
+  // parse into a copy so a corrupt state leaves the generator untouched
+  std::default_random_engine gen;
+  std::istringstream rng_stream(rng);
+  if(!(rng_stream >> gen)) {
+    throw std::runtime_error("Corrupt random generator state");
+  }
+  gen_ = gen;
+
+  // a state saved before initialization keeps the configured particle count
+  particles_ = std::move(particles);
+  is_initialized_ = initialized != 0;
+  if(is_initialized_) {
+    num_particles_ = count;
+  }
+}
+
+std::vector<particle_t> ParticleFilter::emigrants(size_t count) const {
+  std::vector<uint32_t> order(particles_.size());
+  for(size_t i=0; i<order.size(); i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  count = std::min(count, order.size());
+  std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](uint32_t a, uint32_t b) {
+    return particles_[a].weight > particles_[b].weight;
+  });
+  std::vector<particle_t> emigrants;
+  for(size_t k=0; k<count; k++) {
+    const state_t& s = particles_[order[k]];
+    emigrants.push_back(particle_t{s.id, s.x, s.y, s.theta, s.weight, {}, {}, {}});
+  }
+  return emigrants;
+}
+
+void ParticleFilter::immigrate(const std::vector<particle_t>& particles) {
+  size_t count = std::min(particles.size(), particles_.size());
+  if(count == 0) {
+    return;
+  }
+  std::vector<uint32_t> order(particles_.size());
+  for(size_t i=0; i<order.size(); i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  std::nth_element(order.begin(), order.begin() + (count - 1), order.end(), [&](uint32_t a, uint32_t b) {
+    return particles_[a].weight < particles_[b].weight;
+  });
+  for(size_t k=0; k<count; k++) {
+    const particle_t& p = particles[k];
+    state_t& s = particles_[order[k]];
+    s = state_t{p.id, p.x, p.y, 0.0, 0.0, 0.0, p.weight, NO_ROW};
+    s.setHeading(p.theta);
+  }
+}
+
+bbox_t ParticleFilter::bounds() const {
+  bbox_t box{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+             std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+  std::mutex mutex;
+  forRanges(particles_.size(), [&](size_t begin, size_t end) {
+    bbox_t b = box;
+    for(size_t i=begin; i<end; i++) {
+      const state_t& p = particles_[i];
+      b.min_x = std::min(b.min_x, p.x);
+      b.min_y = std::min(b.min_y, p.y);
+      b.max_x = std::max(b.max_x, p.x);
+      b.max_y = std::max(b.max_y, p.y);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    box = bbox_t{std::min(box.min_x, b.min_x), std::min(box.min_y, b.min_y),
+                 std::max(box.max_x, b.max_x), std::max(box.max_y, b.max_y)};
+  });
+  return box;
+}
+
+int ParticleFilter::kldParticles(const kld_config_t& config) const {
+  if(particles_.empty()) {
+    return config.min_particles;
+  }
+  bbox_t box = bounds();
+  size_t angles = static_cast<size_t>(std::ceil(2*M_PI / config.bin_angle));
+  double bin_size = config.bin_size;
+  size_t cols, rows;
+  for(;;) {
+    cols = static_cast<size_t>((box.max_x - box.min_x) / bin_size) + 1;
+    rows = static_cast<size_t>((box.max_y - box.min_y) / bin_size) + 1;
+    if(cols * rows * angles <= MAX_KLD_BINS) {
+      break;
+    }
+    bin_size *= 2;
+  }
+
+  // bin of every particle, then the occupied bins
+  std::vector<uint32_t> bins(particles_.size());
+  forRanges(particles_.size(), [&](size_t begin, size_t end) {
+    for(size_t i=begin; i<end; i++) {
+      const state_t& p = particles_[i];
+      size_t col = static_cast<size_t>((p.x - box.min_x) / bin_size);
+      size_t row = static_cast<size_t>((p.y - box.min_y) / bin_size);
+      double theta = std::fmod(p.theta, 2*M_PI);
+      theta += theta < 0 ? 2*M_PI : 0.0;
+      size_t angle = std::min(angles - 1, static_cast<size_t>(theta / config.bin_angle));
+      bins[i] = static_cast<uint32_t>((row * cols + col) * angles + angle);
+    }
+  });
+  std::vector<bool> occupied(cols * rows * angles, false);
+  size_t k = 0;
+  for(uint32_t bin : bins) {
+    if(!occupied[bin]) {
+      occupied[bin] = true;
+      k++;
+    }
+  }
+  if(k <= 1) {
+    return config.min_particles;
+  }
+
+  // Wilson-Hilferty approximation of the chi-square quantile with k - 1 degrees of freedom
+  double a = 2.0 / (9.0 * (k - 1));
+  double n = (k - 1) / (2 * config.epsilon) * std::pow(1 - a + std::sqrt(a) * config.z, 3);
+  return static_cast<int>(std::min<double>(config.max_particles, std::max<double>(config.min_particles, std::ceil(n))));
 }
 
 double ParticleFilter::weighted_error(double gt_x, double gt_y, double gt_theta) {
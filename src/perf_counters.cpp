@@ -0,0 +1,107 @@
+#include "perf_counters.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__linux__)
+
+namespace {
+
+const int NUM_EVENTS = static_cast<int>(PerfEvent::COUNT);
+
+int open_event(uint32_t type, uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  // calling thread, any cpu
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+}
+
+PerfCounters::PerfCounters() : leader_(-1), num_slots_(0) {
+  const uint32_t types[NUM_EVENTS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+  };
+  const uint64_t configs[NUM_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+
+  for(int e=0; e<NUM_EVENTS; e++) {
+    fds_[e] = open_event(types[e], configs[e], leader_);
+    if(fds_[e] < 0) {
+      slot_[e] = -1;
+      if(error_.empty()) {
+        error_ = std::strerror(errno);
+      }
+      continue;
+    }
+    if(leader_ < 0) {
+      leader_ = fds_[e];
+    }
+    slot_[e] = num_slots_++;
+  }
+  if(leader_ >= 0) {
+    error_.clear();
+  } else {
+    error_ = "perf_event_open: " + error_;
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for(int e=0; e<NUM_EVENTS; e++) {
+    if(fds_[e] >= 0) {
+      close(fds_[e]);
+    }
+  }
+}
+
+void PerfCounters::read(perf_sample_t& sample) const {
+  std::memset(&sample, 0, sizeof(sample));
+  if(leader_ < 0) {
+    return;
+  }
+  // PERF_FORMAT_GROUP layout: number of events followed by the values
+  uint64_t buffer[1 + NUM_EVENTS];
+  if(::read(leader_, buffer, sizeof(buffer)) < static_cast<ssize_t>(sizeof(uint64_t) * (1 + num_slots_))) {
+    return;
+  }
+  for(int e=0; e<NUM_EVENTS; e++) {
+    if(slot_[e] >= 0) {
+      sample.values[e] = buffer[1 + slot_[e]];
+    }
+  }
+}
+
+#else
+
+PerfCounters::PerfCounters() : leader_(-1), num_slots_(0), error_("hardware counters require Linux") {
+  for(int e=0; e<static_cast<int>(PerfEvent::COUNT); e++) {
+    fds_[e] = -1;
+    slot_[e] = -1;
+  }
+}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::read(perf_sample_t& sample) const {
+  std::memset(&sample, 0, sizeof(sample));
+}
+
+#endif
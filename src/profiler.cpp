@@ -0,0 +1,255 @@
+#include "profiler.hpp"
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+const char* STAGE_NAMES[] = {
+  "parse", "init", "predict", "update", "resample", "best", "serialize", "send", "frame", "odometry", "checkpoint"
+};
+
+const int NUM_STAGES = static_cast<int>(Stage::COUNT);
+const int NUM_EVENTS = static_cast<int>(PerfEvent::COUNT);
+
+// statistics of one thread
+struct StageHistograms {
+  LatencyHistogram stages[NUM_STAGES];
+
+  // counters of the thread, opened on first use
+  std::unique_ptr<PerfCounters> perf;
+  std::atomic<uint64_t> calls[NUM_STAGES];
+  std::atomic<uint64_t> totals[NUM_STAGES][NUM_EVENTS];
+
+  StageHistograms() {
+    clear_counters();
+  }
+
+  void clear_counters() {
+    for(int s=0; s<NUM_STAGES; s++) {
+      calls[s].store(0, std::memory_order_relaxed);
+      for(int e=0; e<NUM_EVENTS; e++) {
+        totals[s][e].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// single writer increment
+inline void add_relaxed(std::atomic<uint64_t>& a, uint64_t v) {
+  a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// histograms of all threads, kept until exit so late reports include finished threads
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<StageHistograms>> registry;
+
+StageHistograms& local_histograms() {
+  thread_local StageHistograms* local = nullptr;
+  if(!local) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.emplace_back(new StageHistograms());
+    local = registry.back().get();
+  }
+  return *local;
+}
+
+}
+
+const char* stage_name(Stage stage) {
+  return STAGE_NAMES[static_cast<int>(stage)];
+}
+
+LatencyHistogram::LatencyHistogram() {
+  clear();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for(int i=0; i<NUM_BUCKETS; i++) {
+    counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  if(other.max() > max()) {
+    max_.store(other.max(), std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::clear() {
+  for(auto& c : counts_) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t n = 0;
+  for(auto const& c : counts_) {
+    n += c.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+  uint64_t n = count();
+  if(n == 0) {
+    return 0;
+  }
+  // rank of the quantile, 1-based
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * n + 0.5));
+  uint64_t seen = 0;
+  for(int i=0; i<NUM_BUCKETS; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if(seen >= rank) {
+      return std::min(bucket_value(i), max());
+    }
+  }
+  return max();
+}
+
+uint64_t LatencyHistogram::bucket_value(int index) {
+  if(index < 2 * SUB_BUCKETS) {
+    return index;
+  }
+  int exponent = index / SUB_BUCKETS - 1;
+  uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+  return ((mantissa + 1) << exponent) - 1;
+}
+
+std::atomic<bool> Profiler::enabled_(false);
+std::atomic<bool> Profiler::counters_enabled_(false);
+
+void Profiler::enable(bool on) {
+  enabled_.store(on, std::memory_order_relaxed);
+}
+
+void Profiler::record(Stage stage, uint64_t ns) {
+  local_histograms().stages[static_cast<int>(stage)].record(ns);
+}
+
+void Profiler::enable_counters(bool on) {
+  counters_enabled_.store(on, std::memory_order_relaxed);
+}
+
+std::string Profiler::counters_error() {
+  StageHistograms& local = local_histograms();
+  if(!local.perf) {
+    local.perf.reset(new PerfCounters());
+  }
+  return local.perf->error();
+}
+
+void Profiler::read_counters(perf_sample_t& sample) {
+  StageHistograms& local = local_histograms();
+  if(!local.perf) {
+    local.perf.reset(new PerfCounters());
+  }
+  local.perf->read(sample);
+}
+
+void Profiler::add_counters(Stage stage, const perf_sample_t& start) {
+  perf_sample_t end;
+  read_counters(end);
+  StageHistograms& local = local_histograms();
+  int s = static_cast<int>(stage);
+  add_relaxed(local.calls[s], 1);
+  for(int e=0; e<NUM_EVENTS; e++) {
+    add_relaxed(local.totals[s][e], end.values[e] - start.values[e]);
+  }
+}
+
+stage_counters_t Profiler::counters(Stage stage) {
+  int s = static_cast<int>(stage);
+  stage_counters_t merged;
+  merged.calls = 0;
+  for(int e=0; e<NUM_EVENTS; e++) {
+    merged.totals.values[e] = 0;
+  }
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for(auto const& h : registry) {
+    merged.calls += h->calls[s].load(std::memory_order_relaxed);
+    for(int e=0; e<NUM_EVENTS; e++) {
+      merged.totals.values[e] += h->totals[s][e].load(std::memory_order_relaxed);
+    }
+  }
+  return merged;
+}
+
+void Profiler::reset() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for(auto const& h : registry) {
+    for(auto& stage : h->stages) {
+      stage.clear();
+    }
+    h->clear_counters();
+  }
+}
+
+void Profiler::report_counters(std::ostream& out, int num_particles) {
+  std::string error = counters_error();
+  if(!error.empty()) {
+    out << "hardware counters unavailable (" << error << ")" << std::endl;
+    return;
+  }
+  out << std::fixed << std::setprecision(2);
+  out << std::left << std::setw(10) << "stage" << std::right << std::setw(10) << "calls" << std::setw(8) << "IPC";
+  if(num_particles > 0) {
+    out << std::setw(14) << "L1D miss/p" << std::setw(14) << "LLC miss/p" << std::setw(14) << "branch miss/p";
+  }
+  out << std::endl;
+  for(int s=0; s<NUM_STAGES; s++) {
+    stage_counters_t c = counters(static_cast<Stage>(s));
+    if(c.calls == 0) {
+      continue;
+    }
+    const uint64_t* v = c.totals.values;
+    double particles = static_cast<double>(c.calls) * num_particles;
+    double cycles = v[static_cast<int>(PerfEvent::CYCLES)];
+    out << std::left << std::setw(10) << STAGE_NAMES[s] << std::right << std::setw(10) << c.calls
+        << std::setw(8) << (cycles > 0 ? v[static_cast<int>(PerfEvent::INSTRUCTIONS)] / cycles : 0.0);
+    if(num_particles > 0) {
+      out << std::setw(14) << v[static_cast<int>(PerfEvent::L1D_MISSES)] / particles
+          << std::setw(14) << v[static_cast<int>(PerfEvent::LLC_MISSES)] / particles
+          << std::setw(14) << v[static_cast<int>(PerfEvent::BRANCH_MISSES)] / particles;
+    }
+    out << std::endl;
+  }
+}
+
+void Profiler::report(std::ostream& out) {
+  std::unique_ptr<StageHistograms> merged(new StageHistograms());
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for(auto const& h : registry) {
+      for(int s=0; s<NUM_STAGES; s++) {
+        merged->stages[s].merge(h->stages[s]);
+      }
+    }
+  }
+
+  out << std::fixed << std::setprecision(1);
+  out << std::left << std::setw(10) << "stage" << std::right << std::setw(10) << "count"
+      << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+      << std::setw(12) << "p99.9 us" << std::setw(12) << "max us" << std::endl;
+  for(int s=0; s<NUM_STAGES; s++) {
+    const LatencyHistogram& h = merged->stages[s];
+    if(h.count() == 0) {
+      continue;
+    }
+    out << std::left << std::setw(10) << STAGE_NAMES[s] << std::right << std::setw(10) << h.count()
+        << std::setw(12) << h.quantile(0.5) * 1e-3 << std::setw(12) << h.quantile(0.99) * 1e-3
+        << std::setw(12) << h.quantile(0.999) * 1e-3 << std::setw(12) << h.max() * 1e-3 << std::endl;
+  }
+}
+
+void Profiler::report_periodically(double period_s) {
+  std::thread([period_s] {
+    while(true) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(period_s));
+      report(std::cout);
+    }
+  }).detach();
+}
@@ -0,0 +1,134 @@
+#include "scenario.hpp"
+
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+#include "helpers.hpp"
+#include "landmark_map.hpp"
+
+namespace {
+
+// maximum yaw rate of the generated trajectory [rad/s]
+const double MAX_YAW_RATE = 0.5;
+
+double normalize_angle(double a) {
+  return std::atan2(std::sin(a), std::cos(a));
+}
+
+}
+
+scenario_config_t default_scenario_config(const filter_config_t& config) {
+  scenario_config_t c;
+  c.seed = 1;
+  c.num_landmarks = 1000;
+  c.num_observations = 10;
+  c.num_frames = 100;
+  c.delta_t = config.delta_t;
+  c.sensor_range = config.sensor_range;
+  c.velocity = 10;
+  std::copy(config.sigma_pos, config.sigma_pos + 3, c.sigma_pos);
+  std::copy(config.sigma_landmark, config.sigma_landmark + 2, c.sigma_landmark);
+  c.sigma_control[0] = 0.1;
+  c.sigma_control[1] = 0.01;
+  return c;
+}
+
+std::vector<landmark_t> generate_map(const scenario_config_t& config) {
+  std::mt19937 gen(config.seed);
+  // landmark density giving num_observations in sensor range on average
+  double density = std::max(config.num_observations, 1) / (M_PI * config.sensor_range * config.sensor_range);
+  double extent = std::sqrt(config.num_landmarks / density);
+  std::uniform_real_distribution<double> position(0, extent);
+
+  std::vector<landmark_t> map;
+  for(int i=0; i<config.num_landmarks; i++) {
+    landmark_t l;
+    l.id = i + 1;
+    l.x = position(gen);
+    l.y = position(gen);
+    map.push_back(l);
+  }
+  return map;
+}
+
+scenario_t generate_scenario(const scenario_config_t& config, const std::vector<landmark_t>& map) {
+  scenario_t scenario;
+  scenario.map = map;
+  LandmarkMap index(map);
+  const map_view_t& view = index.view();
+
+  // derive an independent stream from the map seed
+  std::mt19937 gen(config.seed * 2654435761u + 1);
+  std::normal_distribution<double> noise_gps_x(0, config.sigma_pos[0]);
+  std::normal_distribution<double> noise_gps_y(0, config.sigma_pos[1]);
+  std::normal_distribution<double> noise_gps_t(0, config.sigma_pos[2]);
+  std::normal_distribution<double> noise_obs_x(0, config.sigma_landmark[0]);
+  std::normal_distribution<double> noise_obs_y(0, config.sigma_landmark[1]);
+  std::normal_distribution<double> noise_v(0, config.sigma_control[0]);
+  std::normal_distribution<double> noise_yaw(0, config.sigma_control[1]);
+  std::uniform_real_distribution<double> heading(-M_PI, M_PI);
+
+  // start in the middle of the map
+  double center_x = (view.min_x + view.max_x) / 2;
+  double center_y = (view.min_y + view.max_y) / 2;
+  double half_w = (view.max_x - view.min_x) / 2;
+  double half_h = (view.max_y - view.min_y) / 2;
+  pose_t pose{center_x, center_y, heading(gen)};
+  double velocity = 0, yaw_rate = 0;
+
+  for(int f=0; f<config.num_frames; f++) {
+    if(f > 0) {
+      // move with the controls chosen in the previous frame
+      if(std::abs(yaw_rate) > 0.00001) {
+        double theta = pose.theta + yaw_rate * config.delta_t;
+        pose.x += velocity / yaw_rate * (std::sin(theta) - std::sin(pose.theta));
+        pose.y += velocity / yaw_rate * (std::cos(pose.theta) - std::cos(theta));
+        pose.theta = normalize_angle(theta);
+      } else {
+        pose.x += velocity * config.delta_t * std::cos(pose.theta);
+        pose.y += velocity * config.delta_t * std::sin(pose.theta);
+      }
+    }
+
+    telemetry_t frame;
+    frame.sense_x = pose.x + noise_gps_x(gen);
+    frame.sense_y = pose.y + noise_gps_y(gen);
+    frame.sense_theta = pose.theta + noise_gps_t(gen);
+    frame.prev_velocity = velocity + (f > 0 ? noise_v(gen) : 0);
+    frame.prev_yawrate = yaw_rate + (f > 0 ? noise_yaw(gen) : 0);
+
+    // nearest landmarks in range, in vehicle coordinates
+    std::vector<std::pair<double, uint32_t>> in_range;
+    view.for_each_in_range(pose.x, pose.y, config.sensor_range, [&](uint32_t i) {
+      in_range.push_back(std::make_pair(dist(view.x[i], view.y[i], pose.x, pose.y), i));
+    });
+    std::sort(in_range.begin(), in_range.end());
+    if(in_range.size() > static_cast<size_t>(config.num_observations)) {
+      in_range.resize(config.num_observations);
+    }
+    double c = std::cos(pose.theta), s = std::sin(pose.theta);
+    for(auto const& l : in_range) {
+      double dx = view.x[l.second] - pose.x;
+      double dy = view.y[l.second] - pose.y;
+      landmark_t obs;
+      obs.id = -1;
+      obs.x = c * dx + s * dy + noise_obs_x(gen);
+      obs.y = -s * dx + c * dy + noise_obs_y(gen);
+      frame.observations.push_back(obs);
+    }
+
+    scenario.ground_truth.push_back(pose);
+    scenario.frames.push_back(frame);
+
+    // controls for the next frame: meander, and steer back to the center near the map border
+    velocity = config.velocity;
+    yaw_rate = 0.2 * std::sin(0.05 * f);
+    if(std::abs(pose.x - center_x) > 0.7 * half_w || std::abs(pose.y - center_y) > 0.7 * half_h) {
+      double bearing = std::atan2(center_y - pose.y, center_x - pose.x);
+      yaw_rate = normalize_angle(bearing - pose.theta) / config.delta_t;
+    }
+    yaw_rate = std::max(-MAX_YAW_RATE, std::min(MAX_YAW_RATE, yaw_rate));
+  }
+  return scenario;
+}
@@ -0,0 +1,361 @@
+#include "session.hpp"
+#include "profiler.hpp"
+#include "telemetry_log.hpp"
+
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// time ahead of the vehicle to prefetch map tiles for [s]
+const double PREFETCH_LOOKAHEAD = 2.0;
+
+// distance of a restored filter from the first position fix it is kept within [sigma_pos]
+const double RESTORE_GATE = 5.0;
+
+bool contains(const bbox_t& outer, const bbox_t& inner) {
+  return inner.min_x >= outer.min_x && inner.max_x <= outer.max_x &&
+         inner.min_y >= outer.min_y && inner.max_y <= outer.max_y;
+}
+
+// flushes a file or directory to disk
+void sync_path(const std::string& path, int flags) {
+  int fd = ::open(path.c_str(), flags);
+  bool synced = fd >= 0 && ::fsync(fd) == 0;
+  if(fd >= 0) {
+    ::close(fd);
+  }
+  if(!synced) {
+    throw std::runtime_error("Cannot sync " + path);
+  }
+}
+
+// directory of a path, for syncing renames in it
+std::string directory(const std::string& path) {
+  size_t slash = path.rfind('/');
+  if(slash == std::string::npos) {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+}
+
+Session::Session(int id, const filter_config_t& config, const map_view_t& map) :
+  id_(id), config_(config), map_(map), tiled_(nullptr),
+  last_x_(std::numeric_limits<double>::quiet_NaN()), last_y_(std::numeric_limits<double>::quiet_NaN()),
+  filter_(config.num_particles), update_deadline_ns_(0), coarse_observations_(0), fine_fraction_(1.0),
+  update_interval_(1), steps_(0),
+  odometry_applied_(false), frames_since_checkpoint_(0), check_restore_(false) {}
+
+Session::Session(int id, const filter_config_t& config, const MapSource& map) :
+  Session(id, config, map.view()) {
+  tiled_ = map.tiled();
+}
+
+Session::~Session() {
+  try {
+    writeCheckpoint();
+  } catch(std::runtime_error& e) {
+    std::cerr << "Session " << id_ << ": " << e.what() << std::endl;
+  }
+}
+
+void Session::enableFlightRecorder(const flight_config_t& config) {
+  recorder_.reset(new FlightRecorder(id_, config));
+}
+
+void Session::enableAutoTune(const tuner_config_t& config) {
+  governor_.reset(new LatencyGovernor(config));
+}
+
+void Session::restore(const std::string& state, uint32_t version) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::istringstream in(state);
+  filter_.load(in, version);
+  last_x_ = last_y_ = std::numeric_limits<double>::quiet_NaN();
+}
+
+bool Session::enableCheckpoints(const checkpoint_config_t& config, const std::string& client) {
+  checkpoint_.reset(new checkpoint_config_t(config));
+  checkpoint_file_ = config.path + "." + client;
+  frames_since_checkpoint_ = 0;
+  const std::string& filename = checkpoint_file_;
+  if(!std::ifstream(filename.c_str())) {
+    return false;
+  }
+  // a broken checkpoint costs a reconvergence, not the session
+  try {
+    TelemetryReader reader(filename);
+    telemetry_record_t record;
+    if(!reader.next(record) || record.type != RecordType::STATE) {
+      throw std::runtime_error("No filter state in checkpoint " + filename);
+    }
+    restore(record.state, record.state_version);
+    // the particle count may have been tuned, the other settings are the configured ones
+    config_.num_particles = record.config.num_particles;
+    filter_.setNumParticles(config_.num_particles);
+    check_restore_ = filter_.initialized();
+  } catch(std::runtime_error& e) {
+    std::cerr << "Session " << id_ << ": " << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void Session::checkpoint() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  writeCheckpoint();
+}
+
+void Session::writeCheckpoint() {
+  if(!checkpoint_ || island_config_ || !filter_.initialized()) {
+    return;
+  }
+  ScopedStage stage(Stage::CHECKPOINT);
+  telemetry_record_t record;
+  record.type = RecordType::STATE;
+  record.session_id = id_;
+  record.config = config_;
+  std::ostringstream state;
+  filter_.save(state);
+  record.state = state.str();
+
+  // sessions of the same client may checkpoint concurrently, the last rename wins
+  const std::string& filename = checkpoint_file_;
+  std::string temporary = filename + ".tmp" + std::to_string(id_);
+  {
+    TelemetryWriter writer(temporary);
+    writer.write(record);
+  }
+  // the data has to be on disk before the rename replaces the previous checkpoint
+  sync_path(temporary, O_WRONLY);
+  if(std::rename(temporary.c_str(), filename.c_str()) != 0) {
+    throw std::runtime_error("Cannot write checkpoint " + filename);
+  }
+  sync_path(directory(filename), O_RDONLY);
+  frames_since_checkpoint_ = 0;
+}
+
+bool Session::nearFix(const telemetry_t& frame) const {
+  pose_t mean = filter_.estimate().mean;
+  return std::abs(mean.x - frame.sense_x) <= RESTORE_GATE * config_.sigma_pos[0] &&
+         std::abs(mean.y - frame.sense_y) <= RESTORE_GATE * config_.sigma_pos[1] &&
+         std::abs(std::remainder(mean.theta - frame.sense_theta, 2*M_PI)) <= RESTORE_GATE * config_.sigma_pos[2];
+}
+
+frame_result_t Session::process(const telemetry_t& frame, uint64_t recv_ns) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return step(&frame, 1, recv_ns);
+}
+
+pose_estimate_t Session::predictOnly(const odometry_t& odometry) {
+  // NaN would reach the noise sigma and the map cell index
+  if(!std::isfinite(odometry.delta_t) || odometry.delta_t <= 0 ||
+     !std::isfinite(odometry.velocity) || !std::isfinite(odometry.yaw_rate)) {
+    throw std::runtime_error("Invalid odometry sample");
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ScopedStage stage(Stage::ODOMETRY);
+  if(islands_) {
+    return islands_->predictOnly(odometry);
+  }
+  if(!filter_.initialized()) {
+    return pose_estimate_t{};
+  }
+  // the configured noise is per frame interval, shorter samples get their share of the variance
+  double scale = std::sqrt(odometry.delta_t / config_.delta_t);
+  double sigma_pos[3] = {config_.sigma_pos[0] * scale, config_.sigma_pos[1] * scale, config_.sigma_pos[2] * scale};
+  filter_.prediction(odometry.delta_t, odometry.velocity, odometry.yaw_rate, sigma_pos);
+  odometry_applied_ = true;
+  return filter_.estimate();
+}
+
+frame_result_t Session::processBacklog(const std::vector<telemetry_t>& frames, uint64_t recv_ns) {
+  if(frames.empty()) {
+    throw std::runtime_error("Empty frame backlog");
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return step(frames.data(), frames.size(), recv_ns);
+}
+
+frame_result_t Session::step(const telemetry_t* frames, size_t count, uint64_t recv_ns) {
+  if(island_config_) {
+    // the islands run the whole iteration
+    if(!islands_) {
+      islands_.reset(new IslandCoordinator(config_, *island_config_, update_deadline_ns_, update_interval_));
+    }
+    return islands_->process(frames, count, recv_ns);
+  }
+
+  // the newest frame has the observations to update with
+  const telemetry_t& frame = frames[count - 1];
+
+  // stage latencies are only collected for the flight recorder
+  uint64_t stage_ns[static_cast<int>(Stage::COUNT)] = {};
+  uint64_t start_ns = 0;
+  if(recorder_) {
+    recorder_->beginFrame(filter_, config_, frames, count);
+  }
+  if(recorder_ || governor_ || update_deadline_ns_) {
+    start_ns = now_ns();
+  }
+  frame_result_t result{particle_t(), pose_estimate_t(), false, 0};
+  auto elapsed = [&](Stage stage) {
+    return recorder_ ? &stage_ns[static_cast<int>(stage)] : nullptr;
+  };
+
+  if(!filter_.initialized()) {
+    // if not initialized, initialize with GPS data
+    ScopedStage stage(Stage::INIT, elapsed(Stage::INIT));
+    if(global_) {
+      // no position fix, the vehicle may be anywhere on the map
+      if(tiled_ || map_.count == 0) {
+        throw std::runtime_error("Global localization needs a map in memory");
+      }
+      filter_.initGlobal(bbox_t{map_.min_x, map_.min_y, map_.max_x, map_.max_y}, global_->num_particles);
+      config_.num_particles = global_->num_particles;
+    } else {
+      filter_.init(frame.sense_x, frame.sense_y, frame.sense_theta, config_.sigma_pos);
+    }
+  } else {
+    // odometry has moved the particles over the control of the oldest frame already
+    size_t skip = odometry_applied_ ? 1 : 0;
+    odometry_applied_ = false;
+    if(count - skip == 1) {
+      // run the prediction step
+      ScopedStage stage(Stage::PREDICT, elapsed(Stage::PREDICT));
+      filter_.prediction(config_.delta_t, frame.prev_velocity, frame.prev_yawrate, config_.sigma_pos);
+    } else if(count - skip > 1) {
+      // a single prediction over the combined controls of the backlog
+      ScopedStage stage(Stage::PREDICT, elapsed(Stage::PREDICT));
+      filter_.predictMotion(compose_controls(frames + skip, count - skip, config_.delta_t), config_.sigma_pos,
+                            count - skip);
+    }
+  }
+
+  if(check_restore_) {
+    // a checkpoint of a vehicle that moved meanwhile is no better than none
+    check_restore_ = false;
+    if(!global_ && !nearFix(frame)) {
+      std::cerr << "Session " << id_ << ": checkpoint too far from the position fix, initializing from GPS" << std::endl;
+      ScopedStage stage(Stage::INIT, elapsed(Stage::INIT));
+      filter_.init(frame.sense_x, frame.sense_y, frame.sense_theta, config_.sigma_pos);
+    }
+  }
+
+  // between updates the particles only move, keeping their weights
+  bool update = update_interval_ <= 1 || steps_++ % update_interval_ == 0;
+  if(!update) {
+    ScopedStage stage(Stage::BEST, elapsed(Stage::BEST));
+    result.estimate = filter_.estimate();
+    result.best = filter_.particle(result.estimate.best_index);
+    return finish(result, stage_ns, start_ns);
+  }
+
+  // Update the weights and resample
+  {
+    ScopedStage stage(Stage::UPDATE, elapsed(Stage::UPDATE));
+    if(tiled_) {
+      updateWorkingSet();
+    }
+    if(update_deadline_ns_) {
+      uint64_t deadline_ns = (recv_ns ? recv_ns : start_ns) + update_deadline_ns_;
+      result.observations_used = filter_.updateWeightsAnytime(config_.sensor_range, config_.sigma_landmark,
+                                                              frame.observations, map_, deadline_ns);
+    } else if(coarse_observations_) {
+      filter_.updateWeightsTwoStage(config_.sensor_range, config_.sigma_landmark, frame.observations, map_,
+                                    coarse_observations_, fine_fraction_);
+      result.observations_used = frame.observations.size();
+    } else {
+      filter_.updateWeights(config_.sensor_range, config_.sigma_landmark, frame.observations, map_);
+      result.observations_used = frame.observations.size();
+    }
+    result.partial = result.observations_used < frame.observations.size();
+  }
+  {
+    ScopedStage stage(Stage::RESAMPLE, elapsed(Stage::RESAMPLE));
+    filter_.resample();
+    if(global_) {
+      // takes effect with the next resample
+      config_.num_particles = filter_.kldParticles(global_->kld);
+      filter_.setNumParticles(config_.num_particles);
+    }
+  }
+
+  {
+    ScopedStage stage(Stage::BEST, elapsed(Stage::BEST));
+    result.estimate = filter_.estimate();
+    result.best = filter_.particle(result.estimate.best_index);
+  }
+  return finish(result, stage_ns, start_ns);
+}
+
+frame_result_t Session::finish(const frame_result_t& result, const uint64_t stage_ns[], uint64_t start_ns) {
+  uint64_t frame_ns = start_ns ? now_ns() - start_ns : 0;
+  if(recorder_) {
+    // a failed dump loses the diagnostics, not the session
+    try {
+      std::string dump = recorder_->endFrame(stage_ns, frame_ns);
+      if(!dump.empty()) {
+        std::cerr << "Session " << id_ << ": slow frame, flight recorder written to " << dump << std::endl;
+      }
+    } catch(std::runtime_error& e) {
+      std::cerr << "Session " << id_ << ": " << e.what() << std::endl;
+    }
+  }
+  if(governor_) {
+    // takes effect with the next resample
+    int num_particles = governor_->update(frame_ns, config_.num_particles);
+    if(num_particles != config_.num_particles) {
+      config_.num_particles = num_particles;
+      filter_.setNumParticles(num_particles);
+    }
+  }
+  if(checkpoint_ && checkpoint_->interval && ++frames_since_checkpoint_ >= checkpoint_->interval) {
+    try {
+      writeCheckpoint();
+    } catch(std::runtime_error& e) {
+      std::cerr << "Session " << id_ << ": " << e.what() << std::endl;
+    }
+  }
+  return result;
+}
+
+void Session::updateWorkingSet() {
+  // every landmark a particle can observe
+  bbox_t region = filter_.bounds();
+  region.min_x -= config_.sensor_range;
+  region.min_y -= config_.sensor_range;
+  region.max_x += config_.sensor_range;
+  region.max_y += config_.sensor_range;
+
+  // the working set only changes when the region leaves the loaded tiles
+  if(!working_set_ || !contains(working_region_, region)) {
+    std::vector<landmark_t> landmarks;
+    working_region_ = tiled_->query(region, landmarks);
+    working_set_.reset(new LandmarkMap(landmarks));
+    map_ = working_set_->view();
+  }
+
+  // prefetch everything the region sweeps over during the lookahead time
+  double center_x = (region.min_x + region.max_x) / 2;
+  double center_y = (region.min_y + region.max_y) / 2;
+  if(!std::isnan(last_x_)) {
+    double shift = PREFETCH_LOOKAHEAD / config_.delta_t;
+    double dx = (center_x - last_x_) * shift;
+    double dy = (center_y - last_y_) * shift;
+    tiled_->prefetch(bbox_t{std::min(region.min_x, region.min_x + dx), std::min(region.min_y, region.min_y + dy),
+                            std::max(region.max_x, region.max_x + dx), std::max(region.max_y, region.max_y + dy)});
+  }
+  last_x_ = center_x;
+  last_y_ = center_y;
+}
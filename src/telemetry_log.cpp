@@ -0,0 +1,161 @@
+#include "telemetry_log.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "helpers.hpp"
+
+namespace {
+
+const char MAGIC[4] = {'P', 'F', 'T', 'L'};
+const uint32_t VERSION = 4;
+
+void truncated() {
+  throw std::runtime_error("Truncated telemetry log");
+}
+
+}
+
+TelemetryWriter::TelemetryWriter(const std::string& filename) :
+  out_(filename.c_str(), std::ofstream::binary | std::ofstream::trunc) {
+  if(!out_) {
+    throw std::runtime_error("Cannot create telemetry log " + filename);
+  }
+  out_.write(MAGIC, sizeof(MAGIC));
+  write_pod(out_, VERSION);
+  out_.flush();
+}
+
+void TelemetryWriter::write(const telemetry_record_t& record) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  write_pod(out_, static_cast<uint8_t>(record.type));
+  write_pod(out_, static_cast<uint32_t>(record.session_id));
+
+  if(record.type == RecordType::FRAME) {
+    const telemetry_t& frame = record.frame;
+    write_pod(out_, record.recv_ns);
+    write_pod(out_, frame.sense_x);
+    write_pod(out_, frame.sense_y);
+    write_pod(out_, frame.sense_theta);
+    write_pod(out_, frame.prev_velocity);
+    write_pod(out_, frame.prev_yawrate);
+    write_pod(out_, static_cast<uint32_t>(frame.observations.size()));
+    for(auto const& obs : frame.observations) {
+      write_pod(out_, static_cast<float>(obs.x));
+      write_pod(out_, static_cast<float>(obs.y));
+    }
+  } else if(record.type == RecordType::STATE) {
+    const filter_config_t& c = record.config;
+    write_pod(out_, static_cast<int32_t>(c.num_particles));
+    write_pod(out_, c.delta_t);
+    write_pod(out_, c.sensor_range);
+    out_.write(reinterpret_cast<const char*>(c.sigma_pos), sizeof(c.sigma_pos));
+    out_.write(reinterpret_cast<const char*>(c.sigma_landmark), sizeof(c.sigma_landmark));
+    write_pod(out_, static_cast<uint64_t>(record.state.size()));
+    out_.write(record.state.data(), record.state.size());
+  } else if(record.type == RecordType::ODOMETRY) {
+    write_pod(out_, record.recv_ns);
+    write_pod(out_, record.odometry.velocity);
+    write_pod(out_, record.odometry.yaw_rate);
+    write_pod(out_, record.odometry.delta_t);
+  } else if(record.type == RecordType::BACKLOG) {
+    write_pod(out_, record.backlog);
+  } else {
+    write_pod(out_, static_cast<uint32_t>(record.stage_ns.size()));
+    for(auto ns : record.stage_ns) {
+      write_pod(out_, ns);
+    }
+  }
+  out_.flush();
+}
+
+TelemetryReader::TelemetryReader(const std::string& filename) :
+  in_(filename.c_str(), std::ifstream::binary), version_(0) {
+  if(!in_) {
+    throw std::runtime_error("Telemetry log not found.");
+  }
+  char magic[4];
+  in_.read(magic, sizeof(magic));
+  if(!in_ || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !read_pod(in_, version_)) {
+    throw std::runtime_error("Not a telemetry log: " + filename);
+  }
+  if(version_ < 1 || version_ > VERSION) {
+    throw std::runtime_error("Unsupported telemetry log version " + std::to_string(version_));
+  }
+}
+
+bool TelemetryReader::next(telemetry_record_t& record) {
+  uint8_t type = static_cast<uint8_t>(RecordType::FRAME);
+  if(version_ >= 2 && !read_pod(in_, type)) {
+    return false;
+  }
+  uint32_t session_id;
+  if(!read_pod(in_, session_id)) {
+    if(version_ >= 2) {
+      truncated();
+    }
+    return false;
+  }
+  record.type = static_cast<RecordType>(type);
+  record.session_id = session_id;
+
+  if(record.type == RecordType::FRAME) {
+    telemetry_t& frame = record.frame;
+    uint32_t num_obs = 0;
+    if(!read_pod(in_, record.recv_ns) ||
+       !read_pod(in_, frame.sense_x) || !read_pod(in_, frame.sense_y) || !read_pod(in_, frame.sense_theta) ||
+       !read_pod(in_, frame.prev_velocity) || !read_pod(in_, frame.prev_yawrate) ||
+       !read_pod(in_, num_obs) || num_obs > stream_remaining(in_) / (2 * sizeof(float))) {
+      truncated();
+    }
+    frame.observations.resize(num_obs);
+    for(auto& obs : frame.observations) {
+      float x, y;
+      if(!read_pod(in_, x) || !read_pod(in_, y)) {
+        truncated();
+      }
+      obs.id = -1;
+      obs.x = x;
+      obs.y = y;
+    }
+  } else if(record.type == RecordType::STATE) {
+    filter_config_t& c = record.config;
+    int32_t num_particles = 0;
+    uint64_t size = 0;
+    if(!read_pod(in_, num_particles) || !read_pod(in_, c.delta_t) || !read_pod(in_, c.sensor_range) ||
+       !in_.read(reinterpret_cast<char*>(c.sigma_pos), sizeof(c.sigma_pos)) ||
+       !in_.read(reinterpret_cast<char*>(c.sigma_landmark), sizeof(c.sigma_landmark)) ||
+       !read_pod(in_, size) || size > stream_remaining(in_)) {
+      truncated();
+    }
+    c.num_particles = num_particles;
+    record.state_version = version_ >= 3 ? 2 : 1;
+    record.state.resize(size);
+    if(!in_.read(&record.state[0], size)) {
+      truncated();
+    }
+  } else if(record.type == RecordType::TIMING) {
+    uint32_t count = 0;
+    if(!read_pod(in_, count) || count > stream_remaining(in_) / sizeof(uint64_t)) {
+      truncated();
+    }
+    record.stage_ns.resize(count);
+    for(auto& ns : record.stage_ns) {
+      if(!read_pod(in_, ns)) {
+        truncated();
+      }
+    }
+  } else if(record.type == RecordType::ODOMETRY) {
+    if(!read_pod(in_, record.recv_ns) || !read_pod(in_, record.odometry.velocity) ||
+       !read_pod(in_, record.odometry.yaw_rate) || !read_pod(in_, record.odometry.delta_t)) {
+      truncated();
+    }
+  } else if(record.type == RecordType::BACKLOG && version_ >= 4) {
+    if(!read_pod(in_, record.backlog)) {
+      truncated();
+    }
+  } else {
+    throw std::runtime_error("Corrupt telemetry log");
+  }
+  return true;
+}
@@ -0,0 +1,110 @@
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// chunks per thread, balances uneven per-item cost against claiming overhead
+const size_t CHUNKS_PER_THREAD = 4;
+
+}
+
+ThreadPool::ThreadPool(int num_threads) : stopping_(false) {
+  for(int i=1; i<num_threads; i++) {
+    workers_.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for(auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t, size_t)>& body, const char* name) {
+  if(count == 0) {
+    return;
+  }
+  if(!name) {
+    name = Tracer::scope() ? Tracer::scope() : "parallel_for";
+  }
+  if(workers_.empty()) {
+    TraceSpan span(name);
+    body(0, count);
+    return;
+  }
+
+  batch_t batch;
+  batch.body = &body;
+  batch.name = name;
+  batch.count = count;
+  batch.chunks = std::min(count, size() * CHUNKS_PER_THREAD);
+  batch.chunk = (count + batch.chunks - 1) / batch.chunks;
+  batch.chunks = (count + batch.chunk - 1) / batch.chunk;
+  batch.next = 0;
+  batch.done = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_.push_back(&batch);
+  work_cv_.notify_all();
+
+  // work on the own batch until all chunks are claimed
+  while(batch.next < batch.chunks) {
+    size_t chunk = batch.next++;
+    if(batch.next == batch.chunks) {
+      queue_.erase(std::find(queue_.begin(), queue_.end(), &batch));
+    }
+    lock.unlock();
+    run(batch, chunk);
+    lock.lock();
+  }
+  done_cv_.wait(lock, [&] { return batch.done == batch.chunks; });
+}
+
+bool ThreadPool::claim(batch_t*& batch, size_t& chunk) {
+  if(queue_.empty()) {
+    return false;
+  }
+  batch = queue_.front();
+  chunk = batch->next++;
+  if(batch->next == batch->chunks) {
+    queue_.pop_front();
+  }
+  return true;
+}
+
+void ThreadPool::run(batch_t& batch, size_t chunk) {
+  size_t begin = chunk * batch.chunk;
+  {
+    // workers have no enclosing span, they show what they run for
+    TraceSpan span(batch.name);
+    (*batch.body)(begin, std::min(batch.count, begin + batch.chunk));
+  }
+
+  // the batch may be gone as soon as the last chunk is marked done
+  std::lock_guard<std::mutex> lock(mutex_);
+  if(++batch.done == batch.chunks) {
+    done_cv_.notify_all();
+  }
+}
+
+void ThreadPool::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true) {
+    batch_t* batch = nullptr;
+    size_t chunk = 0;
+    work_cv_.wait(lock, [&] { return stopping_ || claim(batch, chunk); });
+    if(!batch) {
+      return;
+    }
+    lock.unlock();
+    run(*batch, chunk);
+    lock.lock();
+  }
+}
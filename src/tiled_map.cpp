@@ -0,0 +1,306 @@
+#include "tiled_map.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const char MAGIC[8] = {'P', 'F', 'T', 'I', 'L', 'E', 'S', 0};
+
+// reads exactly size bytes at offset
+bool read_at(int fd, void* buffer, size_t size, uint64_t offset) {
+  char* out = static_cast<char*>(buffer);
+  while(size > 0) {
+    ssize_t n = pread(fd, out, size, offset);
+    if(n <= 0) {
+      return false;
+    }
+    out += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+}
+
+void write_tiled_map(const std::string& filename, const std::vector<landmark_t>& landmarks, double tile_size) {
+  if(tile_size <= 0) {
+    throw std::invalid_argument("Tile size must be positive");
+  }
+  tiled_map_header_t h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = TILED_MAP_FORMAT_VERSION;
+  h.count = landmarks.size();
+  h.tile_size = tile_size;
+
+  double max_x = 0, max_y = 0;
+  if(!landmarks.empty()) {
+    h.origin_x = h.origin_y = std::numeric_limits<double>::max();
+    max_x = max_y = std::numeric_limits<double>::lowest();
+  }
+  for(auto const& l : landmarks) {
+    h.origin_x = std::min(h.origin_x, l.x);
+    h.origin_y = std::min(h.origin_y, l.y);
+    max_x = std::max(max_x, l.x);
+    max_y = std::max(max_y, l.y);
+  }
+  h.cols = static_cast<uint32_t>((max_x - h.origin_x) / tile_size) + 1;
+  h.rows = static_cast<uint32_t>((max_y - h.origin_y) / tile_size) + 1;
+
+  // bucket landmarks by tile
+  std::vector<std::vector<tile_landmark_t>> tiles(uint64_t(h.cols) * h.rows);
+  for(auto const& l : landmarks) {
+    uint32_t c = std::min<uint32_t>((l.x - h.origin_x) / tile_size, h.cols - 1);
+    uint32_t r = std::min<uint32_t>((l.y - h.origin_y) / tile_size, h.rows - 1);
+    tiles[r * h.cols + c].push_back(tile_landmark_t{l.id, 0, l.x, l.y});
+  }
+
+  std::vector<tile_entry_t> directory(tiles.size());
+  uint64_t offset = sizeof(h) + sizeof(tile_entry_t) * directory.size();
+  for(size_t t=0; t<tiles.size(); t++) {
+    directory[t].offset = offset;
+    directory[t].count = tiles[t].size();
+    directory[t].reserved = 0;
+    offset += sizeof(tile_landmark_t) * tiles[t].size();
+  }
+
+  std::ofstream out(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.write(reinterpret_cast<const char*>(directory.data()), sizeof(tile_entry_t) * directory.size());
+  for(auto const& tile : tiles) {
+    out.write(reinterpret_cast<const char*>(tile.data()), sizeof(tile_landmark_t) * tile.size());
+  }
+  if(!out) {
+    throw std::runtime_error("Cannot write tiled map " + filename);
+  }
+}
+
+TiledMap::TiledMap(const std::string& filename, size_t memory_cap) :
+  memory_cap_(memory_cap), resident_bytes_(0), stop_(false) {
+  fd_ = open(filename.c_str(), O_RDONLY);
+  if(fd_ < 0) {
+    throw std::runtime_error("Map file not found.");
+  }
+  if(!read_at(fd_, &header_, sizeof(header_), 0) ||
+     std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    close(fd_);
+    throw std::runtime_error("Not a tiled map: " + filename);
+  }
+  if(header_.version != TILED_MAP_FORMAT_VERSION) {
+    close(fd_);
+    throw std::runtime_error("Unsupported tiled map version " + std::to_string(header_.version));
+  }
+  off_t size = lseek(fd_, 0, SEEK_END);
+  file_size_ = size < 0 ? 0 : static_cast<uint64_t>(size);
+  if(!(header_.tile_size > 0) ||
+     sizeof(header_) + sizeof(tile_entry_t) * uint64_t(header_.cols) * header_.rows > file_size_) {
+    close(fd_);
+    throw std::runtime_error("Corrupt tiled map");
+  }
+  prefetcher_ = std::thread(&TiledMap::prefetch_loop, this);
+}
+
+TiledMap::~TiledMap() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  queue_cv_.notify_all();
+  prefetcher_.join();
+  close(fd_);
+}
+
+bbox_t TiledMap::query(const bbox_t& region, std::vector<landmark_t>& landmarks) {
+  const double infinity = std::numeric_limits<double>::infinity();
+  double map_min_x = header_.origin_x, map_max_x = header_.origin_x + header_.cols * header_.tile_size;
+  double map_min_y = header_.origin_y, map_max_y = header_.origin_y + header_.rows * header_.tile_size;
+  std::vector<uint32_t> tiles = tiles_in(region);
+  if(tiles.empty()) {
+    // beyond the map there are no landmarks, the region misses it on at least one side
+    bbox_t outside{-infinity, -infinity, infinity, infinity};
+    if(region.max_x < map_min_x) {
+      outside.max_x = map_min_x;
+    } else if(region.min_x >= map_max_x) {
+      outside.min_x = map_max_x;
+    } else if(region.max_y < map_min_y) {
+      outside.max_y = map_min_y;
+    } else {
+      outside.min_y = map_max_y;
+    }
+    return outside;
+  }
+
+  bbox_t covered{infinity, infinity, -infinity, -infinity};
+  std::unique_lock<std::mutex> lock(mutex_);
+  for(uint32_t t : tiles) {
+    auto it = tiles_.find(t);
+    while(it == tiles_.end()) {
+      if(loading_.count(t)) {
+        // already being loaded by the prefetcher
+        loaded_cv_.wait(lock);
+      } else {
+        loading_.insert(t);
+        lock.unlock();
+        std::vector<tile_landmark_t> data;
+        try {
+          data = load(t);
+        } catch(...) {
+          lock.lock();
+          loading_.erase(t);
+          loaded_cv_.notify_all();
+          throw;
+        }
+        lock.lock();
+        loading_.erase(t);
+        insert(t, std::move(data));
+        loaded_cv_.notify_all();
+      }
+      it = tiles_.find(t);
+    }
+
+    // mark as most recently used
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    for(auto const& l : it->second.landmarks) {
+      landmarks.push_back(landmark_t{l.id, l.x, l.y});
+    }
+
+    double x0 = header_.origin_x + (t % header_.cols) * header_.tile_size;
+    double y0 = header_.origin_y + (t / header_.cols) * header_.tile_size;
+    covered.min_x = std::min(covered.min_x, x0);
+    covered.min_y = std::min(covered.min_y, y0);
+    covered.max_x = std::max(covered.max_x, x0 + header_.tile_size);
+    covered.max_y = std::max(covered.max_y, y0 + header_.tile_size);
+  }
+
+  // the edge tiles cover everything beyond the map edges as well
+  if(region.min_x < map_min_x) {
+    covered.min_x = -infinity;
+  }
+  if(region.min_y < map_min_y) {
+    covered.min_y = -infinity;
+  }
+  if(region.max_x >= map_max_x) {
+    covered.max_x = infinity;
+  }
+  if(region.max_y >= map_max_y) {
+    covered.max_y = infinity;
+  }
+  return covered;
+}
+
+void TiledMap::prefetch(const bbox_t& region) {
+  std::vector<uint32_t> tiles = tiles_in(region);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // only the latest prediction matters
+    queue_.clear();
+    for(uint32_t t : tiles) {
+      if(!tiles_.count(t) && !loading_.count(t)) {
+        queue_.push_back(t);
+      }
+    }
+  }
+  queue_cv_.notify_one();
+}
+
+size_t TiledMap::resident_bytes() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return resident_bytes_;
+}
+
+std::vector<uint32_t> TiledMap::tiles_in(const bbox_t& region) const {
+  std::vector<uint32_t> tiles;
+  double size = header_.tile_size;
+  double c0 = std::floor((region.min_x - header_.origin_x) / size);
+  double c1 = std::floor((region.max_x - header_.origin_x) / size);
+  double r0 = std::floor((region.min_y - header_.origin_y) / size);
+  double r1 = std::floor((region.max_y - header_.origin_y) / size);
+  // no overlap with the map
+  if(c1 < 0 || r1 < 0 || c0 >= header_.cols || r0 >= header_.rows) {
+    return tiles;
+  }
+  uint32_t col0 = std::max(c0, 0.0), col1 = std::min<double>(c1, header_.cols - 1);
+  uint32_t row0 = std::max(r0, 0.0), row1 = std::min<double>(r1, header_.rows - 1);
+  for(uint32_t r=row0; r<=row1; r++) {
+    for(uint32_t c=col0; c<=col1; c++) {
+      tiles.push_back(r * header_.cols + c);
+    }
+  }
+  return tiles;
+}
+
+std::vector<tile_landmark_t> TiledMap::load(uint32_t tile) const {
+  tile_entry_t entry;
+  std::vector<tile_landmark_t> landmarks;
+  if(!read_at(fd_, &entry, sizeof(entry), sizeof(header_) + sizeof(tile_entry_t) * uint64_t(tile))) {
+    throw std::runtime_error("Corrupt tiled map");
+  }
+  // a corrupt entry must not allocate more than the file holds
+  if(entry.offset > file_size_ || entry.count > (file_size_ - entry.offset) / sizeof(tile_landmark_t)) {
+    throw std::runtime_error("Corrupt tiled map");
+  }
+  landmarks.resize(entry.count);
+  if(!read_at(fd_, landmarks.data(), sizeof(tile_landmark_t) * entry.count, entry.offset)) {
+    throw std::runtime_error("Corrupt tiled map");
+  }
+  return landmarks;
+}
+
+void TiledMap::insert(uint32_t tile, std::vector<tile_landmark_t>&& landmarks) {
+  if(tiles_.count(tile)) {
+    return;
+  }
+  lru_.push_front(tile);
+  tile_t& entry = tiles_[tile];
+  entry.landmarks = std::move(landmarks);
+  entry.lru = lru_.begin();
+  resident_bytes_ += sizeof(tile_t) + sizeof(tile_landmark_t) * entry.landmarks.size();
+
+  // evict least recently used tiles, but never the one just loaded
+  while(resident_bytes_ > memory_cap_ && lru_.size() > 1) {
+    uint32_t victim = lru_.back();
+    auto it = tiles_.find(victim);
+    resident_bytes_ -= sizeof(tile_t) + sizeof(tile_landmark_t) * it->second.landmarks.size();
+    tiles_.erase(it);
+    lru_.pop_back();
+  }
+}
+
+void TiledMap::prefetch_loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while(true) {
+    queue_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if(stop_) {
+      return;
+    }
+    uint32_t t = queue_.front();
+    queue_.pop_front();
+    if(tiles_.count(t) || loading_.count(t)) {
+      continue;
+    }
+    loading_.insert(t);
+    lock.unlock();
+    std::vector<tile_landmark_t> data;
+    bool loaded = true;
+    try {
+      data = load(t);
+    } catch(std::runtime_error&) {
+      // leave it to the synchronous path to report the error
+      loaded = false;
+    }
+    lock.lock();
+    loading_.erase(t);
+    if(loaded) {
+      insert(t, std::move(data));
+    }
+    loaded_cv_.notify_all();
+  }
+}
@@ -0,0 +1,143 @@
+#include "trace.hpp"
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <cstdio>
+#include <stdexcept>
+#include <iostream>
+#include <condition_variable>
+
+namespace {
+
+// spans per thread buffered between two flushes
+const uint64_t RING_SIZE = 1 << 14;
+// flush period [ms]
+const int FLUSH_PERIOD_MS = 100;
+
+struct span_t {
+  const char* name;
+  uint64_t begin_ns;
+  uint64_t end_ns;
+};
+
+// single producer (recording thread), single consumer (flush thread) ring
+struct SpanRing {
+  explicit SpanRing(int tid) : tid(tid), head(0), tail(0), dropped(0) {}
+
+  int tid;
+  span_t spans[RING_SIZE];
+  std::atomic<uint64_t> head;     // next write position
+  std::atomic<uint64_t> tail;     // next read position
+  std::atomic<uint64_t> dropped;  // spans lost to overflow
+};
+
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<SpanRing>> rings;
+
+// flush thread state
+std::mutex flush_mutex;
+std::condition_variable flush_cv;
+std::thread flusher;
+bool stopping = false;
+FILE* trace_file = nullptr;
+bool first_event = true;
+uint64_t origin_ns = 0;
+
+SpanRing& local_ring() {
+  thread_local SpanRing* local = nullptr;
+  if(!local) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new SpanRing(static_cast<int>(rings.size()) + 1));
+    local = rings.back().get();
+  }
+  return *local;
+}
+
+// writes all buffered spans, requires flush_mutex
+void drain() {
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for(auto& ring : rings) {
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    for(; tail != head; tail++) {
+      const span_t& s = ring->spans[tail % RING_SIZE];
+      std::fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                   first_event ? "\n" : ",\n", s.name, ring->tid,
+                   (s.begin_ns - origin_ns) * 1e-3, (s.end_ns - s.begin_ns) * 1e-3);
+      first_event = false;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+  std::fflush(trace_file);
+}
+
+void flush_loop() {
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  while(!stopping) {
+    flush_cv.wait_for(lock, std::chrono::milliseconds(FLUSH_PERIOD_MS));
+    drain();
+  }
+}
+
+}
+
+std::atomic<bool> Tracer::enabled_(false);
+thread_local const char* Tracer::scope_ = nullptr;
+
+void Tracer::start(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(flush_mutex);
+  if(trace_file) {
+    return;
+  }
+  trace_file = std::fopen(filename.c_str(), "w");
+  if(!trace_file) {
+    throw std::runtime_error("Cannot create trace file " + filename);
+  }
+  std::fputs("[", trace_file);
+  origin_ns = now_ns();
+  stopping = false;
+  flusher = std::thread(flush_loop);
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::stop() {
+  if(!enabled()) {
+    return;
+  }
+  enabled_.store(false, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    stopping = true;
+  }
+  flush_cv.notify_all();
+  flusher.join();
+
+  std::lock_guard<std::mutex> lock(flush_mutex);
+  drain();
+  uint64_t dropped = 0;
+  {
+    std::lock_guard<std::mutex> rings_lock(rings_mutex);
+    for(auto const& ring : rings) {
+      dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+  }
+  std::fputs("\n]\n", trace_file);
+  std::fclose(trace_file);
+  trace_file = nullptr;
+  if(dropped) {
+    std::cerr << "Trace ring overflow, dropped " << dropped << " spans" << std::endl;
+  }
+}
+
+void Tracer::record(const char* name, uint64_t begin_ns, uint64_t end_ns) {
+  SpanRing& ring = local_ring();
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  if(head - ring.tail.load(std::memory_order_acquire) >= RING_SIZE) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring.spans[head % RING_SIZE] = span_t{name, begin_ns, end_ns};
+  ring.head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,378 @@
+/*
+ * Headless benchmark suite
+ * Runs the particle filter on deterministic synthetic scenarios for a matrix of
+ * particle counts, map sizes and observation counts and times every filter stage.
+ * Results are written as one JSON object per case and line for trend tracking.
+ *
+ * Usage: bench [--particles=100,1000,...] [--landmarks=1000,...] [--observations=10,...]
+ *              [--frames=20] [--max-seconds=10] [--seed=1] [--map=map_data.txt] [--output=bench.jsonl]
+ *              [--counters] [--budget-ms=B] [--max-threads=N]
+ *              [--threads=1] [--resampler=wheel|systematic|metropolis]
+ *              [--coarse-observations=M] [--fine-fraction=0.1]
+ *
+ * With --counters every stage also reports IPC and cache/branch misses per particle
+ * from the hardware performance counters, when the kernel permits them. The counters
+ * only see the calling thread, so with --threads only its IPC is reported.
+ * With --budget-ms the benchmark instead calibrates the largest particle count and
+ * update thread count meeting a p99 frame latency budget on the first map size and
+ * observation count, and writes the result as a single JSON line.
+ * --threads runs the cases on a thread pool, --resampler selects the resampling algorithm,
+ * --coarse-observations runs the two-stage weight update.
+ * After every case the filter is saved, restored and stepped once more next to the original
+ * to check that a restored filter continues bit-identically ("restore_identical"), and
+ * reinitialized far away to check that only the fresh particles remain ("reinit_replaces").
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include "json.h"
+#include "types.hpp"
+#include "helpers.hpp"
+#include "scenario.hpp"
+#include "landmark_map.hpp"
+#include "particle_filter.hpp"
+#include "profiler.hpp"
+#include "auto_tuner.hpp"
+#include "session.hpp"
+
+namespace {
+
+// filter stages timed per frame
+enum BenchStage { INIT, PREDICT, UPDATE, RESAMPLE, BEST, FRAME, NUM_STAGES };
+const Stage PROFILER_STAGES[NUM_STAGES] = {
+  Stage::INIT, Stage::PREDICT, Stage::UPDATE, Stage::RESAMPLE, Stage::BEST, Stage::FRAME
+};
+
+std::vector<int> parse_list(const std::string& s) {
+  std::vector<int> values;
+  std::stringstream ss(s);
+  std::string item;
+  while(std::getline(ss, item, ',')) {
+    values.push_back(std::stoi(item));
+  }
+  return values;
+}
+
+// summary statistics of a stage [us]
+nlohmann::json summarize(std::vector<uint64_t> samples) {
+  nlohmann::json j;
+  if(samples.empty()) {
+    return j;
+  }
+  std::sort(samples.begin(), samples.end());
+  uint64_t total = 0;
+  for(auto s : samples) {
+    total += s;
+  }
+  j["count"] = samples.size();
+  j["mean_us"] = total * 1e-3 / samples.size();
+  j["p50_us"] = samples[samples.size() / 2] * 1e-3;
+  j["max_us"] = samples.back() * 1e-3;
+  return j;
+}
+
+// hardware counter rates of a stage, only IPC of the calling thread without num_particles
+void add_counters(nlohmann::json& j, Stage stage, int num_particles) {
+  stage_counters_t c = Profiler::counters(stage);
+  if(c.calls == 0) {
+    return;
+  }
+  const uint64_t* v = c.totals.values;
+  double particles = static_cast<double>(c.calls) * num_particles;
+  double cycles = v[static_cast<int>(PerfEvent::CYCLES)];
+  j["ipc"] = cycles > 0 ? v[static_cast<int>(PerfEvent::INSTRUCTIONS)] / cycles : 0.0;
+  if(num_particles == 0) {
+    return;
+  }
+  j["cycles_per_particle"] = cycles / particles;
+  j["l1d_misses_per_particle"] = v[static_cast<int>(PerfEvent::L1D_MISSES)] / particles;
+  j["llc_misses_per_particle"] = v[static_cast<int>(PerfEvent::LLC_MISSES)] / particles;
+  j["branch_misses_per_particle"] = v[static_cast<int>(PerfEvent::BRANCH_MISSES)] / particles;
+}
+
+// steps the filter over one telemetry frame
+void step(ParticleFilter& filter, const telemetry_t& frame, filter_config_t& config, const map_view_t& map,
+          size_t coarse_observations, double fine_fraction) {
+  filter.prediction(config.delta_t, frame.prev_velocity, frame.prev_yawrate, config.sigma_pos);
+  if(coarse_observations) {
+    filter.updateWeightsTwoStage(config.sensor_range, config.sigma_landmark, frame.observations, map,
+                                 coarse_observations, fine_fraction);
+  } else {
+    filter.updateWeights(config.sensor_range, config.sigma_landmark, frame.observations, map);
+  }
+  filter.resample();
+}
+
+// saves the filter, loads it into a fresh one, steps both over the frame and checks they stay bit-identical
+bool restore_identical(ParticleFilter& filter, ThreadPool* pool, Resampler resampler, const telemetry_t& frame,
+                       filter_config_t& config, const map_view_t& map,
+                       size_t coarse_observations, double fine_fraction) {
+  std::stringstream saved;
+  filter.save(saved);
+  ParticleFilter restored(1);  // the particle count comes with the state
+  restored.setThreadPool(pool);
+  restored.setResampler(resampler);
+  restored.load(saved);
+  step(filter, frame, config, map, coarse_observations, fine_fraction);
+  step(restored, frame, config, map, coarse_observations, fine_fraction);
+  std::ostringstream a, b;
+  filter.save(a);
+  restored.save(b);
+  return a.str() == b.str();
+}
+
+// restores the filter and reinitializes it far away, as a session does when it rejects a checkpoint,
+// and checks that only the new particles remain, centered on the new fix
+bool reinit_replaces(ParticleFilter& filter, int num_particles, filter_config_t& config) {
+  std::stringstream saved;
+  filter.save(saved);
+  ParticleFilter restored(1);
+  restored.load(saved);
+  const double x = 1000, y = -1000, theta = 1;
+  restored.init(x, y, theta, config.sigma_pos);
+  pose_estimate_t estimate = restored.estimate();
+  // every fresh particle has weight 1
+  return estimate.weight_sum == num_particles &&
+         std::fabs(estimate.mean.x - x) < 5*config.sigma_pos[0] &&
+         std::fabs(estimate.mean.y - y) < 5*config.sigma_pos[1];
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<int> particle_counts = {100, 1000, 10000, 100000, 1000000};
+  std::vector<int> landmark_counts = {1000, 10000, 100000};
+  std::vector<int> observation_counts = {10, 30};
+  int num_frames = 20;
+  double max_seconds = 10;
+  uint32_t seed = 1;
+  std::string map_file;
+  std::string output_file;
+  bool counters = false;
+  double budget_ms = 0;
+  int max_threads = 0;
+  int num_threads = 1;
+  Resampler resampler = Resampler::WHEEL;
+  std::string resampler_name = "wheel";
+  size_t coarse_observations = 0;
+  double fine_fraction = 0.1;
+
+  for(int i=1; i<argc; i++) {
+    std::string value;
+    if(parse_flag(argv[i], "particles", value)) {
+      particle_counts = parse_list(value);
+    } else if(parse_flag(argv[i], "landmarks", value)) {
+      landmark_counts = parse_list(value);
+    } else if(parse_flag(argv[i], "observations", value)) {
+      observation_counts = parse_list(value);
+    } else if(parse_flag(argv[i], "frames", value)) {
+      num_frames = std::max(2, std::stoi(value));
+    } else if(parse_flag(argv[i], "max-seconds", value)) {
+      max_seconds = std::stod(value);
+    } else if(parse_flag(argv[i], "seed", value)) {
+      seed = std::stoul(value);
+    } else if(parse_flag(argv[i], "map", value)) {
+      map_file = value;
+    } else if(parse_flag(argv[i], "output", value)) {
+      output_file = value;
+    } else if(std::string(argv[i]) == "--counters") {
+      counters = true;
+    } else if(parse_flag(argv[i], "budget-ms", value)) {
+      budget_ms = std::stod(value);
+    } else if(parse_flag(argv[i], "max-threads", value)) {
+      max_threads = std::stoi(value);
+    } else if(parse_flag(argv[i], "threads", value)) {
+      num_threads = std::max(1, std::stoi(value));
+    } else if(parse_flag(argv[i], "resampler", value) && parse_resampler(value, resampler)) {
+      resampler_name = value;
+    } else if(parse_flag(argv[i], "coarse-observations", value)) {
+      coarse_observations = std::stoul(value);
+    } else if(parse_flag(argv[i], "fine-fraction", value)) {
+      fine_fraction = std::stod(value);
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--particles=100,1000,...] [--landmarks=1000,...]"
+                << " [--observations=10,...] [--frames=20] [--max-seconds=10] [--seed=1]"
+                << " [--map=map_data.txt] [--output=bench.jsonl] [--counters] [--budget-ms=B] [--max-threads=N]"
+                << " [--threads=1] [--resampler=wheel|systematic|metropolis]"
+                << " [--coarse-observations=M] [--fine-fraction=0.1]" << std::endl;
+      return -1;
+    }
+  }
+
+  // a given map replaces the generated ones
+  std::vector<landmark_t> fixed_map;
+  if(!map_file.empty()) {
+    try {
+      fixed_map = read_map(map_file);
+    } catch(std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+    landmark_counts = {static_cast<int>(fixed_map.size())};
+  }
+
+  std::ofstream output_stream;
+  if(!output_file.empty()) {
+    output_stream.open(output_file.c_str());
+  }
+  std::ostream& out = output_file.empty() ? std::cout : output_stream;
+
+  if(counters) {
+    std::string error = Profiler::counters_error();
+    if(error.empty()) {
+      Profiler::enable_counters(true);
+      if(num_threads > 1) {
+        std::cerr << "hardware counters miss the thread pool workers, per particle rates skipped" << std::endl;
+      }
+    } else {
+      std::cerr << "hardware counters unavailable (" << error << "), timing only" << std::endl;
+    }
+  }
+
+  filter_config_t config = default_filter_config();
+  std::cerr << std::fixed << std::setprecision(1);
+
+  if(budget_ms > 0) {
+    // calibration needs enough frames for a meaningful p99
+    const int CALIBRATION_FRAMES = 100;
+    scenario_config_t sc = default_scenario_config(config);
+    sc.seed = seed;
+    sc.num_landmarks = landmark_counts.front();
+    sc.num_observations = observation_counts.front();
+    sc.num_frames = std::max(num_frames, CALIBRATION_FRAMES);
+    scenario_t scenario = generate_scenario(sc, map_file.empty() ? generate_map(sc) : fixed_map);
+    LandmarkMap map(scenario.map);
+
+    tuner_config_t tuner = default_tuner_config(static_cast<uint64_t>(budget_ms * 1e6));
+    if(max_threads > 0) {
+      tuner.max_threads = max_threads;
+    }
+    tuning_t tuning = calibrate(tuner, config, scenario.frames, map.view(), &std::cerr, [&](Session& session) {
+      session.setResampler(resampler);
+      session.setTwoStageUpdate(coarse_observations, fine_fraction);
+    });
+
+    nlohmann::json result;
+    result["budget_ms"] = budget_ms;
+    result["landmarks"] = sc.num_landmarks;
+    result["observations"] = sc.num_observations;
+    result["particles"] = tuning.num_particles;
+    result["threads"] = tuning.num_threads;
+    result["p99_us"] = tuning.p99_ns * 1e-3;
+    result["met"] = tuning.p99_ns > 0;
+    out << result.dump() << std::endl;
+    return 0;
+  }
+  ThreadPool pool(num_threads);
+  for(int num_landmarks : landmark_counts) {
+    for(int num_observations : observation_counts) {
+      scenario_config_t sc = default_scenario_config(config);
+      sc.seed = seed;
+      sc.num_landmarks = num_landmarks;
+      sc.num_observations = num_observations;
+      sc.num_frames = num_frames;
+      scenario_t scenario = generate_scenario(sc, map_file.empty() ? generate_map(sc) : fixed_map);
+      LandmarkMap map(scenario.map);
+
+      for(int num_particles : particle_counts) {
+        ParticleFilter filter(num_particles);
+        filter.setThreadPool(num_threads > 1 ? &pool : nullptr);
+        filter.setResampler(resampler);
+        std::vector<uint64_t> samples[NUM_STAGES];
+        Profiler::reset();
+        size_t total_observations = 0;
+
+        uint64_t case_start = now_ns();
+        int frames = 0;
+        for(auto const& frame : scenario.frames) {
+          ScopedStage frame_stage(Stage::FRAME);
+          uint64_t t0 = now_ns();
+          if(!filter.initialized()) {
+            ScopedStage stage(Stage::INIT);
+            filter.init(frame.sense_x, frame.sense_y, frame.sense_theta, config.sigma_pos);
+          } else {
+            ScopedStage stage(Stage::PREDICT);
+            filter.prediction(config.delta_t, frame.prev_velocity, frame.prev_yawrate, config.sigma_pos);
+          }
+          uint64_t t1 = now_ns();
+          samples[frames == 0 ? INIT : PREDICT].push_back(t1 - t0);
+          {
+            ScopedStage stage(Stage::UPDATE);
+            if(coarse_observations) {
+              filter.updateWeightsTwoStage(config.sensor_range, config.sigma_landmark, frame.observations, map.view(),
+                                           coarse_observations, fine_fraction);
+            } else {
+              filter.updateWeights(config.sensor_range, config.sigma_landmark, frame.observations, map.view());
+            }
+          }
+          uint64_t t2 = now_ns();
+          {
+            ScopedStage stage(Stage::RESAMPLE);
+            filter.resample();
+          }
+          uint64_t t3 = now_ns();
+          {
+            ScopedStage stage(Stage::BEST);
+            filter.estimate();
+          }
+          uint64_t t4 = now_ns();
+          samples[UPDATE].push_back(t2 - t1);
+          samples[RESAMPLE].push_back(t3 - t2);
+          samples[BEST].push_back(t4 - t3);
+          samples[FRAME].push_back(t4 - t0);
+          total_observations += frame.observations.size();
+          frames++;
+
+          // keep huge cases bounded, but time at least one predict frame
+          if(frames >= 2 && (now_ns() - case_start) * 1e-9 > max_seconds) {
+            break;
+          }
+        }
+
+        const pose_t& gt = scenario.ground_truth[frames - 1];
+        nlohmann::json result;
+        result["particles"] = num_particles;
+        result["landmarks"] = num_landmarks;
+        result["observations"] = num_observations;
+        result["mean_observations"] = static_cast<double>(total_observations) / frames;
+        result["frames"] = frames;
+        result["seed"] = seed;
+        result["threads"] = num_threads;
+        result["resampler"] = resampler_name;
+        result["coarse_observations"] = coarse_observations;
+        result["fine_fraction"] = fine_fraction;
+        result["error"] = filter.weighted_error(gt.x, gt.y, gt.theta);
+        bool identical = restore_identical(filter, num_threads > 1 ? &pool : nullptr, resampler, scenario.frames[frames - 1],
+                                           config, map.view(), coarse_observations, fine_fraction);
+        result["restore_identical"] = identical;
+        if(!identical) {
+          std::cerr << "warning: restored filter diverges from the saved one" << std::endl;
+        }
+        bool replaces = reinit_replaces(filter, num_particles, config);
+        result["reinit_replaces"] = replaces;
+        if(!replaces) {
+          std::cerr << "warning: reinitializing a restored filter keeps stale particles" << std::endl;
+        }
+        for(int s=0; s<NUM_STAGES; s++) {
+          nlohmann::json stage = summarize(samples[s]);
+          if(Profiler::counters_enabled()) {
+            // counters miss the pool workers, their work per particle is unknown
+            add_counters(stage, PROFILER_STAGES[s], num_threads > 1 ? 0 : num_particles);
+          }
+          result["stages"][stage_name(PROFILER_STAGES[s])] = stage;
+        }
+        out << result.dump() << std::endl;
+
+        std::cerr << "particles " << std::setw(8) << num_particles
+                  << "  landmarks " << std::setw(7) << num_landmarks
+                  << "  observations " << std::setw(3) << num_observations
+                  << "  frame mean " << std::setw(10) << result["stages"]["frame"]["mean_us"].get<double>() << " us"
+                  << "  error " << result["error"].get<double>() << std::endl;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * Island worker
+ * Runs a share of the particles of an island filter (see island.hpp) for
+ * the coordinating server or replay. Started by the coordinator, not by hand.
+ *
+ * Usage: island_worker <socket fd> <map_data.txt|map.bin|map.tiles>
+ */
+#include <iostream>
+#include <string>
+
+#include "island.hpp"
+
+int main(int argc, char* argv[]) {
+  if(argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <socket fd> <map_data.txt|map.bin|map.tiles>" << std::endl;
+    return -1;
+  }
+  return run_island_worker(std::stoi(argv[1]), argv[2]);
+}
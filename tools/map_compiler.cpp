@@ -0,0 +1,66 @@
+/*
+ * Map compiler
+ * Converts a text map (x y id per line) into a binary map file with
+ * structure-of-arrays landmarks and a prebuilt grid index, which the
+ * filter memory maps at startup, or into a tiled map (*.tiles) which the
+ * filter streams from disk around the vehicle, or into a C++ header (*.hpp)
+ * which embeds the binary map layout into the server (cmake -DEMBED_MAP=...).
+ *
+ * Usage: map_compiler <map_data.txt> <map.bin|map.tiles|map.hpp> [--cell=25] [--tile=100]
+ */
+#include <iostream>
+
+#include "helpers.hpp"
+#include "landmark_map.hpp"
+#include "map_file.hpp"
+#include "tiled_map.hpp"
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> files;
+  double cell_size = LandmarkMap::DEFAULT_CELL_SIZE;
+  double tile_size = 100;
+  for(int i=1; i<argc; i++) {
+    std::string value;
+    if(parse_flag(argv[i], "cell", value)) {
+      cell_size = std::stod(value);
+    } else if(parse_flag(argv[i], "tile", value)) {
+      tile_size = std::stod(value);
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if(files.size() != 2) {
+    std::cerr << "Usage: " << argv[0] << " <map_data.txt> <map.bin|map.tiles|map.hpp> [--cell=" << cell_size
+              << "] [--tile=" << tile_size << "]" << std::endl;
+    return -1;
+  }
+
+  auto has_extension = [&](const std::string& ext) {
+    return files[1].size() >= ext.size() && files[1].compare(files[1].size() - ext.size(), ext.size(), ext) == 0;
+  };
+  bool tiled = has_extension(".tiles");
+  bool header = has_extension(".hpp") || has_extension(".h");
+
+  try {
+    if(tiled) {
+      std::vector<landmark_t> landmarks = read_map(files[0]);
+      write_tiled_map(files[1], landmarks, tile_size);
+      std::cout << "Wrote " << landmarks.size() << " landmarks in " << tile_size
+                << " m tiles to " << files[1] << std::endl;
+      return 0;
+    }
+    LandmarkMap map(read_map(files[0]), cell_size);
+    if(header) {
+      write_map_header(files[1], map.view(), files[0]);
+    } else {
+      write_map_file(files[1], map.view());
+    }
+    const map_view_t& v = map.view();
+    std::cout << "Wrote " << v.count << " landmarks, " << v.cols << "x" << v.rows
+              << " grid of " << v.cell_size << " m cells to " << files[1] << std::endl;
+  } catch(std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Shared memory map service
+ * Publishes a map with its grid index as a POSIX shared memory segment, so
+ * the filter processes of a host (servers, island workers, replays) attach
+ * it read-only with --map=shm:<name> instead of each loading a private copy.
+ * The segment is removed when the service is stopped with SIGINT or SIGTERM.
+ *
+ * Usage: map_service <map_data.txt|map.bin> [--name=/pf_map] [--cell=25]
+ */
+#include <iostream>
+#include <memory>
+#include <csignal>
+
+#include "helpers.hpp"
+#include "landmark_map.hpp"
+#include "map_file.hpp"
+
+int main(int argc, char* argv[]) {
+  std::string map_file;
+  std::string name = "/pf_map";
+  double cell_size = LandmarkMap::DEFAULT_CELL_SIZE;
+  for(int i=1; i<argc; i++) {
+    std::string value;
+    if(parse_flag(argv[i], "name", value)) {
+      name = value;
+    } else if(parse_flag(argv[i], "cell", value)) {
+      cell_size = std::stod(value);
+    } else if(map_file.empty() && std::string(argv[i]).compare(0, 2, "--") != 0) {
+      map_file = argv[i];
+    } else {
+      map_file.clear();
+      break;
+    }
+  }
+  if(map_file.empty()) {
+    std::cerr << "Usage: " << argv[0] << " <map_data.txt|map.bin> [--name=/pf_map] [--cell=" << cell_size << "]" << std::endl;
+    return -1;
+  }
+
+  // block the signals before waiting, so they cannot end the process in between
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  try {
+    const std::string ext = ".bin";
+    bool binary = map_file.size() >= ext.size() && map_file.compare(map_file.size() - ext.size(), ext.size(), ext) == 0;
+    std::unique_ptr<MappedMap> mapped;
+    std::unique_ptr<LandmarkMap> memory;
+    if(binary) {
+      mapped.reset(new MappedMap(map_file));
+    } else {
+      memory.reset(new LandmarkMap(read_map(map_file), cell_size));
+    }
+    const map_view_t& view = binary ? mapped->view() : memory->view();
+    publish_shared_map(name, view);
+    std::cout << "Published " << view.count << " landmarks (" << map_image_size(view) << " bytes) as "
+              << SHARED_MAP_PREFIX << name << std::endl;
+  } catch(std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+
+  int signal = 0;
+  sigwait(&signals, &signal);
+  unlink_shared_map(name);
+  std::cout << "Removed " << SHARED_MAP_PREFIX << name << std::endl;
+  return 0;
+}
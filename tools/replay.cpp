@@ -0,0 +1,400 @@
+/*
+ * Offline replay driver
+ * Feeds a recorded telemetry log through the same Session pipeline used
+ * with the simulator, either as fast as possible or at the recorded pace,
+ * and reports throughput and per-frame latency.
+ * Flight recorder dumps restore the recorded filter state first and
+ * compare the recorded stage latencies with the replayed ones.
+ *
+ * Usage: replay <telemetry.log> [--map=../data/map_data.txt|map.bin|map.tiles] [--particles=N] [--paced]
+ *               [--stats] [--counters] [--trace=trace.json]
+ *               [--flight-threshold-ms=T] [--flight-frames=100] [--flight-dir=.]
+ *               [--pool-threads=N] [--latency-budget-ms=B] [--update-deadline-ms=D]
+ *               [--coalesce] [--update-every=K] [--resampler=wheel|systematic|metropolis]
+ *               [--islands=N] [--island-exchange=0.05] [--island-exchange-every=10] [--island-worker=path]
+ *               [--checkpoint=path] [--checkpoint-every=100] [--global=N] [--kld-epsilon=0.05]
+ *               [--coarse-observations=M] [--fine-fraction=0.1]
+ *
+ * With --paced --coalesce, frames whose arrival time passed while the previous
+ * one was processed are coalesced like the server does. Backlogs recorded by
+ * the flight recorder are always processed together as they were.
+ * With --checkpoint, sessions start from their checkpoint if there is one
+ * and write it like the server, e.g. to replay a log across a warm restart.
+ */
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+
+#include "types.hpp"
+#include "helpers.hpp"
+#include "session.hpp"
+#include "telemetry_log.hpp"
+#include "map_file.hpp"
+#include "profiler.hpp"
+
+namespace {
+
+// latency percentile of a sorted sample [ns]
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+  if(sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  std::string log_file;
+  std::string map_file = "../data/map_data.txt";
+  bool paced = false;
+  bool stats = false;
+  bool counters = false;
+  std::string trace_file;
+  filter_config_t config = default_filter_config();
+  flight_config_t flight{100, 0, "."};
+  int pool_threads = 1;
+  double budget_ms = 0;
+  double deadline_ms = 0;
+  bool coalesce = false;
+  int update_every = 1;
+  Resampler resampler = Resampler::WHEEL;
+  island_config_t island = default_island_config(0, sibling_executable(argv[0], "island_worker"), map_file);
+  checkpoint_config_t checkpoint{"", 100};
+  // particles of global localization (0: initialize from GPS) and its KLD error bound
+  int global_particles = 0;
+  double kld_epsilon = 0.05;
+  // observations of the coarse update stage (0: single stage) and share of the particles refined
+  size_t coarse_observations = 0;
+  double fine_fraction = 0.1;
+
+  for(int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    std::string value;
+    if(parse_flag(arg, "map", value)) {
+      map_file = value;
+    } else if(parse_flag(arg, "particles", value)) {
+      config.num_particles = std::stoi(value);
+    } else if(arg == "--paced") {
+      paced = true;
+    } else if(arg == "--stats") {
+      stats = true;
+    } else if(arg == "--counters") {
+      counters = true;
+    } else if(parse_flag(arg, "trace", value)) {
+      trace_file = value;
+    } else if(parse_flag(arg, "flight-threshold-ms", value)) {
+      flight.threshold_ns = static_cast<uint64_t>(std::stod(value) * 1e6);
+    } else if(parse_flag(arg, "flight-frames", value)) {
+      flight.frames = std::stoul(value);
+    } else if(parse_flag(arg, "flight-dir", value)) {
+      flight.directory = value;
+    } else if(parse_flag(arg, "pool-threads", value)) {
+      pool_threads = std::stoi(value);
+    } else if(parse_flag(arg, "latency-budget-ms", value)) {
+      budget_ms = std::stod(value);
+    } else if(parse_flag(arg, "update-deadline-ms", value)) {
+      deadline_ms = std::stod(value);
+    } else if(arg == "--coalesce") {
+      coalesce = true;
+    } else if(parse_flag(arg, "update-every", value)) {
+      update_every = std::stoi(value);
+    } else if(parse_flag(arg, "resampler", value) && parse_resampler(value, resampler)) {
+    } else if(parse_flag(arg, "islands", value)) {
+      island.islands = std::stoi(value);
+    } else if(parse_flag(arg, "island-exchange", value)) {
+      island.exchange_fraction = std::stod(value);
+    } else if(parse_flag(arg, "island-exchange-every", value)) {
+      island.exchange_interval = std::stoi(value);
+    } else if(parse_flag(arg, "island-worker", value)) {
+      island.worker = value;
+    } else if(parse_flag(arg, "checkpoint", value)) {
+      checkpoint.path = value;
+    } else if(parse_flag(arg, "checkpoint-every", value)) {
+      checkpoint.interval = std::stoul(value);
+    } else if(parse_flag(arg, "global", value)) {
+      global_particles = std::stoi(value);
+    } else if(parse_flag(arg, "kld-epsilon", value)) {
+      kld_epsilon = std::stod(value);
+    } else if(parse_flag(arg, "coarse-observations", value)) {
+      coarse_observations = std::stoul(value);
+    } else if(parse_flag(arg, "fine-fraction", value)) {
+      fine_fraction = std::stod(value);
+    } else if(log_file.empty() && arg.compare(0, 2, "--") != 0) {
+      log_file = arg;
+    } else {
+      log_file.clear();
+      break;
+    }
+  }
+  if(log_file.empty()) {
+    std::cerr << "Usage: " << argv[0] << " <telemetry.log> [--map=map_data.txt] [--particles=N] [--paced] [--stats] [--counters]"
+              << " [--trace=trace.json] [--flight-threshold-ms=T] [--flight-frames=100] [--flight-dir=.]"
+              << " [--pool-threads=N] [--latency-budget-ms=B]"
+              << " [--update-deadline-ms=D] [--coalesce] [--update-every=K]"
+              << " [--resampler=wheel|systematic|metropolis]"
+              << " [--islands=N] [--island-exchange=0.05] [--island-exchange-every=10] [--island-worker=path]"
+              << " [--checkpoint=path] [--checkpoint-every=100]"
+              << " [--global=N] [--kld-epsilon=0.05] [--coarse-observations=M] [--fine-fraction=0.1]" << std::endl;
+    return -1;
+  }
+
+  if(island.islands > 0 && deadline_ms > 0) {
+    std::cerr << "--islands cannot be combined with --update-deadline-ms" << std::endl;
+    return -1;
+  }
+  if(global_particles > 0 && island.islands > 0) {
+    std::cerr << "--global cannot be combined with --islands" << std::endl;
+    return -1;
+  }
+  if(flight.threshold_ns && access(flight.directory.c_str(), W_OK) != 0) {
+    std::cerr << "--flight-dir " << flight.directory << " is not a writable directory" << std::endl;
+    return -1;
+  }
+
+  island.map_file = map_file;
+  std::unique_ptr<MapSource> map;
+  std::unique_ptr<TelemetryReader> reader;
+  try {
+    map.reset(new MapSource(map_file));
+    reader.reset(new TelemetryReader(log_file));
+    if(!trace_file.empty()) {
+      Tracer::start(trace_file);
+    }
+  } catch(std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+  if(global_particles > 0 && (map->tiled() || map->view().count == 0)) {
+    std::cerr << "--global needs a map in memory, not a tiled or empty one" << std::endl;
+    return -1;
+  }
+
+  ThreadPool pool(pool_threads);
+  tuner_config_t tuner = default_tuner_config(static_cast<uint64_t>(budget_ms * 1e6));
+  // applies the server options to a new session
+  auto configure = [&](Session& session) {
+    session.setThreadPool(&pool);
+    session.setUpdateDeadline(static_cast<uint64_t>(deadline_ms * 1e6));
+    session.setUpdateInterval(update_every);
+    session.setResampler(resampler);
+    session.setTwoStageUpdate(coarse_observations, fine_fraction);
+    if(island.islands > 0) {
+      session.enableIslands(island);
+    }
+    if(budget_ms > 0) {
+      session.enableAutoTune(tuner);
+    }
+    if(flight.threshold_ns) {
+      session.enableFlightRecorder(flight);
+    }
+    if(global_particles > 0) {
+      global_config_t global{global_particles, default_kld_config(config.num_particles, global_particles)};
+      global.kld.epsilon = kld_epsilon;
+      session.enableGlobalLocalization(global);
+    }
+  };
+
+  // one session per recorded connection, like the server
+  std::map<int, std::unique_ptr<Session>> sessions;
+  std::vector<uint64_t> latencies;
+  particle_t best_particle{};
+  pose_estimate_t estimate{};
+  size_t partial_frames = 0;
+  size_t coalesced_frames = 0;
+
+  // predict-only odometry steps
+  std::vector<uint64_t> odometry_latencies;
+  pose_t last_pose{0.0, 0.0, 0.0};
+
+  // recorded frame latencies from timing records, by replayed frame
+  std::vector<std::pair<size_t, uint64_t>> recorded;
+
+  Profiler::enable(stats);
+  Profiler::enable_counters(counters);
+
+  telemetry_record_t record;
+  uint64_t first_recv_ns = 0;
+  bool first_frame = true;
+  uint64_t start_ns = now_ns();
+  // replay time a frame arrived at when paced [ns]
+  auto due = [&](const telemetry_record_t& r) {
+    return start_ns + (r.recv_ns - first_recv_ns);
+  };
+  // waits until a record's original arrival time relative to the first frame
+  auto wait_until_due = [&](const telemetry_record_t& r) {
+    uint64_t due_ns = due(r);
+    uint64_t t = now_ns();
+    if(due_ns > t) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(due_ns - t));
+    }
+  };
+  auto read = [&]() {
+    try {
+      return reader->next(record);
+    } catch(std::runtime_error& e) {
+      std::cerr << e.what() << ", stopping replay" << std::endl;
+      return false;
+    }
+  };
+
+  bool more = read();
+  while(more) {
+    std::unique_ptr<Session>& session = sessions[record.session_id];
+    if(record.type == RecordType::STATE) {
+      // continue from the recorded filter state with the recorded configuration
+      session.reset(new Session(record.session_id, record.config, *map));
+      session->restore(record.state, record.state_version);
+      configure(*session);
+      more = read();
+      continue;
+    }
+    if(record.type == RecordType::TIMING) {
+      size_t frame = static_cast<int>(Stage::FRAME);
+      if(!latencies.empty() && record.stage_ns.size() > frame) {
+        recorded.push_back(std::make_pair(latencies.size() - 1, record.stage_ns[frame]));
+      }
+      more = read();
+      continue;
+    }
+    if(record.type == RecordType::ODOMETRY) {
+      // odometry before the first frame has nothing to move
+      if(session) {
+        if(paced) {
+          wait_until_due(record);
+        }
+        uint64_t odometry_start_ns = now_ns();
+        try {
+          last_pose = session->predictOnly(record.odometry).mean;
+        } catch(std::runtime_error& e) {
+          std::cerr << e.what() << std::endl;
+          return -1;
+        }
+        odometry_latencies.push_back(now_ns() - odometry_start_ns);
+      }
+      more = read();
+      continue;
+    }
+
+    // the frames following a backlog record were processed together
+    size_t backlog = 0;
+    if(record.type == RecordType::BACKLOG) {
+      backlog = record.backlog;
+      int session_id = record.session_id;
+      more = read();
+      if(!more || record.type != RecordType::FRAME || record.session_id != session_id) {
+        std::cerr << "Backlog record without frames, stopping replay" << std::endl;
+        break;
+      }
+    }
+
+    if(first_frame) {
+      first_recv_ns = record.recv_ns;
+      first_frame = false;
+    }
+    if(paced) {
+      wait_until_due(record);
+    }
+
+    if(!session) {
+      session.reset(new Session(record.session_id, config, *map));
+      configure(*session);
+      // recorded session ids identify the vehicle within a log
+      if(!checkpoint.path.empty() && session->enableCheckpoints(checkpoint, std::to_string(record.session_id))) {
+        std::cout << "Session " << record.session_id << " restored from checkpoint" << std::endl;
+      }
+    }
+
+    // frames of the session that arrived while it was busy are processed together
+    int session_id = record.session_id;
+    std::vector<telemetry_t> frames(1, record.frame);
+    more = read();
+    while(more && record.type == RecordType::FRAME && record.session_id == session_id &&
+          (backlog ? frames.size() < backlog : coalesce && due(record) <= now_ns())) {
+      frames.push_back(record.frame);
+      more = read();
+    }
+    coalesced_frames += frames.size() - 1;
+
+    uint64_t frame_start_ns = now_ns();
+    try {
+      ScopedStage stage(Stage::FRAME);
+      frame_result_t result = session->processBacklog(frames);
+      best_particle = result.best;
+      estimate = result.estimate;
+      partial_frames += result.partial;
+    } catch(std::runtime_error& e) {
+      // e.g. an island worker failed
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+    latencies.push_back(now_ns() - frame_start_ns);
+  }
+  uint64_t elapsed_ns = now_ns() - start_ns;
+  Tracer::stop();
+
+  if(latencies.empty()) {
+    std::cout << "No frames in " << log_file << std::endl;
+    return 0;
+  }
+
+  uint64_t total_ns = 0;
+  for(auto l : latencies) {
+    total_ns += l;
+  }
+  std::vector<uint64_t> sorted = latencies;
+  std::sort(sorted.begin(), sorted.end());
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "frames:      " << latencies.size() << " (" << sessions.size() << " sessions)" << std::endl;
+  std::cout << "wall time:   " << elapsed_ns * 1e-9 << " s" << std::endl;
+  std::cout << "frames/s:    " << latencies.size() / (elapsed_ns * 1e-9) << std::endl;
+  std::cout << "latency us:  mean " << total_ns * 1e-3 / latencies.size()
+            << "  p50 " << percentile(sorted, 0.50) * 1e-3
+            << "  p99 " << percentile(sorted, 0.99) * 1e-3
+            << "  max " << sorted.back() * 1e-3 << std::endl;
+  if(!odometry_latencies.empty()) {
+    std::sort(odometry_latencies.begin(), odometry_latencies.end());
+    std::cout << "odometry us: p50 " << percentile(odometry_latencies, 0.50) * 1e-3
+              << "  p99 " << percentile(odometry_latencies, 0.99) * 1e-3
+              << "  (" << odometry_latencies.size() << " samples, last mean pose "
+              << last_pose.x << " " << last_pose.y << " " << last_pose.theta << ")" << std::endl;
+  }
+  if(coalesce || coalesced_frames) {
+    std::cout << "coalesced:   " << coalesced_frames << " frames" << std::endl;
+  }
+  if(deadline_ms > 0) {
+    std::cout << "partial:     " << partial_frames << " frames" << std::endl;
+  }
+  std::cout << "last pose:   " << best_particle.x << " " << best_particle.y << " " << best_particle.theta << std::endl;
+  std::cout << "mean pose:   " << estimate.mean.x << " " << estimate.mean.y << " " << estimate.mean.theta
+            << "  (sd " << std::sqrt(estimate.covariance[0]) << " " << std::sqrt(estimate.covariance[4])
+            << " " << std::sqrt(estimate.covariance[8]) << ")" << std::endl;
+  if(!recorded.empty()) {
+    // slowest recorded frame next to its replayed latency
+    auto slowest = std::max_element(recorded.begin(), recorded.end(),
+      [](const std::pair<size_t, uint64_t>& a, const std::pair<size_t, uint64_t>& b) {
+        return a.second < b.second;
+      });
+    std::cout << "slowest:     frame " << slowest->first << " recorded " << slowest->second * 1e-3
+              << " us, replayed " << latencies[slowest->first] * 1e-3 << " us" << std::endl;
+  }
+  if(stats) {
+    std::cout << std::endl;
+    Profiler::report(std::cout);
+  }
+  if(counters) {
+    std::cout << std::endl;
+    if(pool_threads > 1 && Profiler::counters_error().empty()) {
+      std::cerr << "hardware counters miss the thread pool workers, per particle rates skipped" << std::endl;
+    }
+    Profiler::report_counters(std::cout, pool_threads > 1 ? 0 : config.num_particles);
+  }
+  return 0;
+}